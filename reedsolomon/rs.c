@@ -41,6 +41,14 @@
 #include <assert.h>
 #include "rs.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define RS_SIMD_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define RS_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
 typedef unsigned char gf;
 
 #define GF_BITS  8
@@ -56,22 +64,43 @@ typedef unsigned char gf;
  * A value related to the multiplication is held in a local variable
  * declared with USE_GF_MULC . See usage in addmul1().
  */
-#define USE_GF_MULC register gf * __gf_mulc_
+#define USE_GF_MULC register const gf * __gf_mulc_
 #define GF_MULC0(c) __gf_mulc_ = &gf_mul_table[(c)<<8]
 #define GF_ADDMULC(dst, x) dst ^= __gf_mulc_[x]
 #define GF_MULC(dst, x) dst = __gf_mulc_[x]
 
-#define gf_mul(x,y) gf_mul_table[(x<<8)+y]
+#define gf_mul(x,y) gf_mul_table[((x)<<8)+(y)]
 
 /*
  * To speed up computations, we have tables for logarithm, exponent
  * multiplication and inverse of a number.
+ *
+ * Split-nibble multiplication tables are used by the vectorized kernels:
+ * c * x == gf_mul_lo[c][x & 0xf] ^ gf_mul_hi[c][x >> 4]
+ * so a 16 byte shuffle looks up 16 products at once.
+ *
+ * The tables never change, so they are generated ahead of time into
+ * rs_tables.h and live in read-only data:
+ *   cc -DRS_GENERATE_TABLES rs.c -o rs_gen_tables && ./rs_gen_tables > rs_tables.h
  */
+#ifdef RS_GENERATE_TABLES
 static gf gf_exp[2*GF_SIZE];
 static int gf_log[GF_SIZE + 1];
 static gf inverse[GF_SIZE+1];
 static gf gf_mul_table[(GF_SIZE + 1)*(GF_SIZE + 1)] __attribute__((aligned (256)));
+static gf gf_mul_lo[GF_SIZE + 1][16] __attribute__((aligned (64)));
+static gf gf_mul_hi[GF_SIZE + 1][16] __attribute__((aligned (64)));
+#else
+#include "rs_tables.h"
+#endif
+
+/*
+ * dst = c * src (mul) or dst ^= c * src (addmul), c != 0.
+ * Selected in reed_solomon_init() based on the CPU we run on.
+ */
+typedef void (*gf_kernel)(gf *dst, gf *src, gf c, int sz);
 
+#ifdef RS_GENERATE_TABLES
 /*
  * modnn(x) computes x % GF_SIZE, where GF_SIZE is 2**GF_BITS - 1,
  * without a slow divide.
@@ -83,29 +112,180 @@ static inline gf modnn(int x) {
     }
     return x;
 }
+#endif
 
-static void addmul(gf *dst1, gf *src1, gf c, int sz) {
+static void addmul_scalar(gf *dst1, gf *src1, gf c, int sz) {
     USE_GF_MULC;
-    if (c != 0) {
-        register gf *dst = dst1, *src = src1;
-        gf *lim = &dst[sz];
+    register gf *dst = dst1, *src = src1;
+    gf *lim = &dst[sz];
 
-        GF_MULC0(c);
-        for (; dst < lim; dst++, src++)
-            GF_ADDMULC(*dst, *src);
-    }
+    GF_MULC0(c);
+    for (; dst < lim; dst++, src++)
+        GF_ADDMULC(*dst, *src);
 }
 
-static void mul(gf *dst1, gf *src1, gf c, int sz) {
+static void mul_scalar(gf *dst1, gf *src1, gf c, int sz) {
     USE_GF_MULC;
-    if (c != 0) {
-        register gf *dst = dst1, *src = src1;
-        gf *lim = &dst[sz];
-        GF_MULC0(c);
-        for (; dst < lim; dst++, src++)
-            GF_MULC(*dst , *src);
-    } else
-        memset(dst1, 0, c);
+    register gf *dst = dst1, *src = src1;
+    gf *lim = &dst[sz];
+
+    GF_MULC0(c);
+    for (; dst < lim; dst++, src++)
+        GF_MULC(*dst, *src);
+}
+
+#if defined(RS_SIMD_X86)
+#define GF_SSSE3_PRODUCT(s) \
+    _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128((s), mask)), \
+                  _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64((s), 4), mask)))
+
+__attribute__((target("ssse3")))
+static void addmul_ssse3(gf *dst, gf *src, gf c, int sz) {
+    __m128i lo = _mm_load_si128((const __m128i*)gf_mul_lo[c]);
+    __m128i hi = _mm_load_si128((const __m128i*)gf_mul_hi[c]);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    int i;
+
+    for (i = 0; i + 16 <= sz; i += 16) {
+        __m128i s = _mm_loadu_si128((__m128i*)&src[i]);
+        __m128i d = _mm_loadu_si128((__m128i*)&dst[i]);
+        _mm_storeu_si128((__m128i*)&dst[i], _mm_xor_si128(d, GF_SSSE3_PRODUCT(s)));
+    }
+    addmul_scalar(&dst[i], &src[i], c, sz - i);
+}
+
+__attribute__((target("ssse3")))
+static void mul_ssse3(gf *dst, gf *src, gf c, int sz) {
+    __m128i lo = _mm_load_si128((const __m128i*)gf_mul_lo[c]);
+    __m128i hi = _mm_load_si128((const __m128i*)gf_mul_hi[c]);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    int i;
+
+    for (i = 0; i + 16 <= sz; i += 16) {
+        __m128i s = _mm_loadu_si128((__m128i*)&src[i]);
+        _mm_storeu_si128((__m128i*)&dst[i], GF_SSSE3_PRODUCT(s));
+    }
+    mul_scalar(&dst[i], &src[i], c, sz - i);
+}
+
+#define GF_AVX2_PRODUCT(s) \
+    _mm256_xor_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256((s), mask)), \
+                     _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64((s), 4), mask)))
+
+__attribute__((target("avx2")))
+static void addmul_avx2(gf *dst, gf *src, gf c, int sz) {
+    __m256i lo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)gf_mul_lo[c]));
+    __m256i hi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)gf_mul_hi[c]));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    int i;
+
+    for (i = 0; i + 32 <= sz; i += 32) {
+        __m256i s = _mm256_loadu_si256((__m256i*)&src[i]);
+        __m256i d = _mm256_loadu_si256((__m256i*)&dst[i]);
+        _mm256_storeu_si256((__m256i*)&dst[i], _mm256_xor_si256(d, GF_AVX2_PRODUCT(s)));
+    }
+    addmul_ssse3(&dst[i], &src[i], c, sz - i);
+}
+
+__attribute__((target("avx2")))
+static void mul_avx2(gf *dst, gf *src, gf c, int sz) {
+    __m256i lo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)gf_mul_lo[c]));
+    __m256i hi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)gf_mul_hi[c]));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    int i;
+
+    for (i = 0; i + 32 <= sz; i += 32) {
+        __m256i s = _mm256_loadu_si256((__m256i*)&src[i]);
+        _mm256_storeu_si256((__m256i*)&dst[i], GF_AVX2_PRODUCT(s));
+    }
+    mul_ssse3(&dst[i], &src[i], c, sz - i);
+}
+
+#define GF_AVX512_PRODUCT(s) \
+    _mm512_xor_si512(_mm512_shuffle_epi8(lo, _mm512_and_si512((s), mask)), \
+                     _mm512_shuffle_epi8(hi, _mm512_and_si512(_mm512_srli_epi64((s), 4), mask)))
+
+__attribute__((target("avx512f,avx512bw")))
+static void addmul_avx512(gf *dst, gf *src, gf c, int sz) {
+    __m512i lo = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i*)gf_mul_lo[c]));
+    __m512i hi = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i*)gf_mul_hi[c]));
+    __m512i mask = _mm512_set1_epi8(0x0f);
+    int i;
+
+    for (i = 0; i + 64 <= sz; i += 64) {
+        __m512i s = _mm512_loadu_si512((void*)&src[i]);
+        __m512i d = _mm512_loadu_si512((void*)&dst[i]);
+        _mm512_storeu_si512((void*)&dst[i], _mm512_xor_si512(d, GF_AVX512_PRODUCT(s)));
+    }
+    addmul_avx2(&dst[i], &src[i], c, sz - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void mul_avx512(gf *dst, gf *src, gf c, int sz) {
+    __m512i lo = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i*)gf_mul_lo[c]));
+    __m512i hi = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i*)gf_mul_hi[c]));
+    __m512i mask = _mm512_set1_epi8(0x0f);
+    int i;
+
+    for (i = 0; i + 64 <= sz; i += 64) {
+        __m512i s = _mm512_loadu_si512((void*)&src[i]);
+        _mm512_storeu_si512((void*)&dst[i], GF_AVX512_PRODUCT(s));
+    }
+    mul_avx2(&dst[i], &src[i], c, sz - i);
+}
+#elif defined(RS_SIMD_NEON)
+static inline uint8x16_t gf_neon_lookup(uint8x16_t table, uint8x16_t idx) {
+#if defined(__aarch64__)
+    return vqtbl1q_u8(table, idx);
+#else
+    uint8x8x2_t t = { { vget_low_u8(table), vget_high_u8(table) } };
+    return vcombine_u8(vtbl2_u8(t, vget_low_u8(idx)), vtbl2_u8(t, vget_high_u8(idx)));
+#endif
+}
+
+#define GF_NEON_PRODUCT(s) \
+    veorq_u8(gf_neon_lookup(lo, vandq_u8((s), mask)), gf_neon_lookup(hi, vshrq_n_u8((s), 4)))
+
+static void addmul_neon(gf *dst, gf *src, gf c, int sz) {
+    uint8x16_t lo = vld1q_u8(gf_mul_lo[c]);
+    uint8x16_t hi = vld1q_u8(gf_mul_hi[c]);
+    uint8x16_t mask = vdupq_n_u8(0x0f);
+    int i;
+
+    for (i = 0; i + 16 <= sz; i += 16) {
+        uint8x16_t s = vld1q_u8(&src[i]);
+        vst1q_u8(&dst[i], veorq_u8(vld1q_u8(&dst[i]), GF_NEON_PRODUCT(s)));
+    }
+    addmul_scalar(&dst[i], &src[i], c, sz - i);
+}
+
+static void mul_neon(gf *dst, gf *src, gf c, int sz) {
+    uint8x16_t lo = vld1q_u8(gf_mul_lo[c]);
+    uint8x16_t hi = vld1q_u8(gf_mul_hi[c]);
+    uint8x16_t mask = vdupq_n_u8(0x0f);
+    int i;
+
+    for (i = 0; i + 16 <= sz; i += 16) {
+        uint8x16_t s = vld1q_u8(&src[i]);
+        vst1q_u8(&dst[i], GF_NEON_PRODUCT(s));
+    }
+    mul_scalar(&dst[i], &src[i], c, sz - i);
+}
+#endif
+
+static gf_kernel addmul_kernel = addmul_scalar;
+static gf_kernel mul_kernel = mul_scalar;
+
+static void addmul(gf *dst, gf *src, gf c, int sz) {
+    if (c != 0)
+        addmul_kernel(dst, src, c, sz);
+}
+
+static void mul(gf *dst, gf *src, gf c, int sz) {
+    if (c != 0)
+        mul_kernel(dst, src, c, sz);
+    else
+        memset(dst, 0, sz);
 }
 
 /* y = a.dot(b) */
@@ -132,6 +312,7 @@ static gf* multiply1(gf *a, int ar, int ac, gf *b, int br, int bc) {
     return new_m;
 }
 
+#ifdef RS_GENERATE_TABLES
 static void init_mul_table(void) {
     int i, j;
     for (i=0; i< GF_SIZE+1; i++)
@@ -140,8 +321,45 @@ static void init_mul_table(void) {
 
     for (j=0; j< GF_SIZE+1; j++)
         gf_mul_table[j] = gf_mul_table[j<<8] = 0;
+
+    for (i=0; i< GF_SIZE+1; i++)
+    for (j=0; j< 16; j++) {
+        gf_mul_lo[i][j] = gf_mul(i, j);
+        gf_mul_hi[i][j] = gf_mul(i, (j << 4));
+    }
 }
+#endif
 
+/*
+ * pick the fastest multiply kernels this CPU supports,
+ * all of them produce the same output as the scalar ones.
+ */
+static void select_kernels(void) {
+    gf_kernel addmul_best = addmul_scalar;
+    gf_kernel mul_best = mul_scalar;
+
+#if defined(RS_SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) {
+        addmul_best = addmul_avx512;
+        mul_best = mul_avx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        addmul_best = addmul_avx2;
+        mul_best = mul_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        addmul_best = addmul_ssse3;
+        mul_best = mul_ssse3;
+    }
+#elif defined(RS_SIMD_NEON)
+    addmul_best = addmul_neon;
+    mul_best = mul_neon;
+#endif
+
+    addmul_kernel = addmul_best;
+    mul_kernel = mul_best;
+}
+
+#ifdef RS_GENERATE_TABLES
 /*
  * initialize the data structures used for computations in GF.
  */
@@ -205,6 +423,7 @@ static void generate_gf(void) {
     for (i=2; i<=GF_SIZE; i++)
         inverse[i] = gf_exp[GF_SIZE-gf_log[i]];
 }
+#endif
 
 /*
  * invert_mat() takes a matrix and produces its inverse
@@ -344,26 +563,51 @@ static gf* sub_matrix(gf* matrix, int rmin, int cmin, int rmax, int cmax,  int n
     return new_m;
 }
 
+/*
+ * the byte range is coded in blocks of this size, so the outputs of a
+ * block stay in L1 while every input is added to them
+ */
+#define CODE_BLOCK_SIZE 4096
+
 /* copy from golang rs version */
-static inline int code_some_shards(gf* matrixRows, gf** inputs, gf** outputs, int dataShards, int outputCount, int byteCount) {
+static inline int code_some_shards_range(gf* matrixRows, gf** inputs, gf** outputs, int dataShards, int outputCount, int offset, int end) {
     gf* in;
-    int iRow, c;
-    for (c = 0; c < dataShards; c++) {
-        in = inputs[c];
-        for (iRow = 0; iRow < outputCount; iRow++) {
-            if (0 == c)
-                mul(outputs[iRow], in, matrixRows[iRow*dataShards+c], byteCount);
-            else
-                addmul(outputs[iRow], in, matrixRows[iRow*dataShards+c], byteCount);
+    int iRow, c, start, size;
+    for (start = offset; start < end; start += CODE_BLOCK_SIZE) {
+        size = end - start;
+        if (size > CODE_BLOCK_SIZE)
+            size = CODE_BLOCK_SIZE;
+
+        for (c = 0; c < dataShards; c++) {
+            in = inputs[c] + start;
+            for (iRow = 0; iRow < outputCount; iRow++) {
+                if (0 == c)
+                    mul(outputs[iRow] + start, in, matrixRows[iRow*dataShards+c], size);
+                else
+                    addmul(outputs[iRow] + start, in, matrixRows[iRow*dataShards+c], size);
+            }
         }
     }
 
     return 0;
 }
 
+static inline int code_some_shards(gf* matrixRows, gf** inputs, gf** outputs, int dataShards, int outputCount, int byteCount) {
+    return code_some_shards_range(matrixRows, inputs, outputs, dataShards, outputCount, 0, byteCount);
+}
+
+/*
+ * The GF tables are static data, so this only picks the multiply kernels.
+ * Concurrent or repeated calls are harmless: every caller stores the
+ * same kernel pointers.
+ */
 void reed_solomon_init(void) {
-    generate_gf();
-    init_mul_table();
+    static volatile int initialized;
+
+    if (!initialized) {
+        select_kernels();
+        initialized = 1;
+    }
 }
 
 reed_solomon* reed_solomon_new(int data_shards, int parity_shards) {
@@ -467,85 +711,6 @@ void reed_solomon_release(reed_solomon* rs) {
     }
 }
 
-/**
- * decode one shard
- * input:
- * rs
- * original data_blocks[rs->data_shards][block_size]
- * dec_fec_blocks[nr_fec_blocks][block_size]
- * fec_block_nos: fec pos number in original fec_blocks
- * erased_blocks: erased blocks in original data_blocks
- * nr_fec_blocks: the number of erased blocks
- * */
-static int reed_solomon_decode(reed_solomon* rs, unsigned char **data_blocks, int block_size, unsigned char **dec_fec_blocks, unsigned int *fec_block_nos, unsigned int *erased_blocks, int nr_fec_blocks) {
-    /* use stack instead of malloc, define a small number of DATA_SHARDS_MAX to save memory */
-    gf dataDecodeMatrix[DATA_SHARDS_MAX*DATA_SHARDS_MAX];
-    unsigned char* subShards[DATA_SHARDS_MAX];
-    unsigned char* outputs[DATA_SHARDS_MAX];
-    gf* m = rs->m;
-    int i, j, c, swap, subMatrixRow, dataShards, nos, nshards;
-
-    /* the erased_blocks should always sorted
-     * if sorted, nr_fec_blocks times to check it
-     * if not, sort it here
-     * */
-    for (i = 0; i < nr_fec_blocks; i++) {
-        swap = 0;
-        for (j = i+1; j < nr_fec_blocks; j++) {
-            if (erased_blocks[i] > erased_blocks[j]) {
-                /* the prefix is bigger than the following, swap */
-                c = erased_blocks[i];
-                erased_blocks[i] = erased_blocks[j];
-                erased_blocks[j] = c;
-
-                swap = 1;
-            }
-        }
-        if (!swap)
-            break;
-    }
-
-    j = 0;
-    subMatrixRow = 0;
-    nos = 0;
-    nshards = 0;
-    dataShards = rs->data_shards;
-    for (i = 0; i < dataShards; i++) {
-        if (j < nr_fec_blocks && i == erased_blocks[j])
-            j++;
-        else {
-            /* this row is ok */
-            for (c = 0; c < dataShards; c++)
-                dataDecodeMatrix[subMatrixRow*dataShards + c] = m[i*dataShards + c];
-
-            subShards[subMatrixRow] = data_blocks[i];
-            subMatrixRow++;
-        }
-    }
-
-    for (i = 0; i < nr_fec_blocks && subMatrixRow < dataShards; i++) {
-        subShards[subMatrixRow] = dec_fec_blocks[i];
-        j = dataShards + fec_block_nos[i];
-        for (c = 0; c < dataShards; c++)
-            dataDecodeMatrix[subMatrixRow*dataShards + c] = m[j*dataShards + c];
-
-        subMatrixRow++;
-    }
-
-    if (subMatrixRow < dataShards)
-        return -1;
-
-    invert_mat(dataDecodeMatrix, dataShards);
-
-    for (i = 0; i < nr_fec_blocks; i++) {
-        j = erased_blocks[i];
-        outputs[i] = data_blocks[j];
-        memmove(dataDecodeMatrix+i*dataShards, dataDecodeMatrix+j*dataShards, dataShards);
-    }
-
-    return code_some_shards(dataDecodeMatrix, subShards, outputs, dataShards, nr_fec_blocks, block_size);
-}
-
 /**
  * encode a big size of buffer
  * input:
@@ -570,56 +735,166 @@ int reed_solomon_encode(reed_solomon* rs, unsigned char** shards, int nr_shards,
 }
 
 /**
- * reconstruct a big size of buffer
+ * fold a data shard into a fec shard
+ * fec_block[offset, block_size) ^= parity[fec_block_no][data_block_no] * data_block[offset, block_size)
+ * once every surviving data shard is folded in, the fec shard only
+ * depends on the erased ones, see reed_solomon_factor() and
+ * reed_solomon_solve_in_place()
+ * */
+int reed_solomon_fold(reed_solomon* rs, unsigned char* fec_block, int fec_block_no, unsigned char* data_block, int data_block_no, int offset, int block_size) {
+    if (fec_block_no < 0 || fec_block_no >= rs->parity_shards || data_block_no < 0 || data_block_no >= rs->data_shards)
+        return -1;
+
+    if (block_size <= offset)
+        return 0;
+
+    addmul(fec_block + offset, data_block + offset, rs->parity[fec_block_no*rs->data_shards + data_block_no], block_size - offset);
+    return 0;
+}
+
+/**
+ * LU factor the fec rows against the erased data columns for
+ * reed_solomon_solve_in_place()
  * input:
  * rs
- * nr_shards: assert(0 == nr_shards % rs->data_shards)
- * shards[nr_shards][block_size]
- * marks[nr_shards] marks as errors
+ * fec_block_nos: fec pos number in original fec_blocks
+ * erased_blocks: erased blocks in original data_blocks
+ * lu[nr_fec_blocks*nr_fec_blocks]: receives the factors
+ * The parity rows built by reed_solomon_new() are the Cauchy matrix
+ * 1/(x_p + y_k) with x_p = p and y_k = parity_shards + k, so the fec rows
+ * used against the erased columns form a Cauchy matrix A_ij = 1/(x_i + y_j).
+ * Eliminating a row and column of r_i * s_j / (x_i + y_j) leaves another
+ * matrix of that form, with
+ *   r_i' = r_i * (x_i + x_k) / (x_i + y_k)
+ *   s_j' = s_j * (y_j + y_k) / (x_k + y_j)
+ * so each row of U and column of L comes straight from the generators and
+ * the factors cost O(nr_fec_blocks^2), without pivoting since every leading
+ * minor of a Cauchy matrix is Cauchy as well. Addition is xor, so nothing
+ * needs negating.
  * */
-int reed_solomon_reconstruct(reed_solomon* rs, unsigned char** shards, unsigned char* marks, int nr_shards, int block_size) {
-    unsigned char *dec_fec_blocks[DATA_SHARDS_MAX];
-    unsigned int fec_block_nos[DATA_SHARDS_MAX];
-    unsigned int erased_blocks[DATA_SHARDS_MAX];
-    unsigned char* fec_marks;
-    unsigned char **data_blocks, **fec_blocks;
-    int i, j, dn, pn, n;
-    int ds = rs->data_shards;
-    int ps = rs->parity_shards;
-    int err = 0;
+int reed_solomon_factor(reed_solomon* rs, unsigned int *fec_block_nos, unsigned int *erased_blocks, int nr_fec_blocks, unsigned char* lu) {
+    gf x[DATA_SHARDS_MAX], y[DATA_SHARDS_MAX];
+    gf r[DATA_SHARDS_MAX], s[DATA_SHARDS_MAX];
+    int n = nr_fec_blocks;
+    int i, j, k;
+    gf ukk;
+
+    if (n <= 0 || n > rs->data_shards)
+        return -1;
 
-    data_blocks = shards;
-    n = nr_shards / rs->shards;
-    fec_marks = marks + n*ds; //after all data, is't fec marks
-    fec_blocks = shards + n*ds;
-
-    for (j = 0; j < n; j++) {
-        dn = 0;
-        for (i = 0; i < ds; i++) {
-            if (marks[i])
-                erased_blocks[dn++] = i;
+    for (i = 0; i < n; i++) {
+        if (fec_block_nos[i] >= (unsigned int)rs->parity_shards || erased_blocks[i] >= (unsigned int)rs->data_shards)
+            return -1;
+
+        x[i] = fec_block_nos[i];
+        y[i] = rs->parity_shards + erased_blocks[i];
+        r[i] = 1;
+        s[i] = 1;
+    }
+
+    /* Doolittle, L has an implied unit diagonal */
+    for (k = 0; k < n; k++) {
+        /* a repeated fec row or erased shard makes A singular */
+        ukk = gf_mul(gf_mul(r[k], s[k]), inverse[x[k] ^ y[k]]);
+        if (ukk == 0)
+            return -1;
+
+        for (j = k+1; j < n; j++)
+            lu[k*n + j] = gf_mul(gf_mul(r[k], s[j]), inverse[x[k] ^ y[j]]);
+
+        /* keep 1/U[k][k] on the diagonal, it's what the solve needs */
+        lu[k*n + k] = inverse[ukk];
+
+        for (i = k+1; i < n; i++) {
+            lu[i*n + k] = gf_mul(gf_mul(r[i], x[k] ^ y[k]), inverse[gf_mul(r[k], x[i] ^ y[k])]);
+
+            r[i] = gf_mul(r[i], gf_mul(x[i] ^ x[k], inverse[x[i] ^ y[k]]));
+            s[i] = gf_mul(s[i], gf_mul(y[i] ^ y[k], inverse[x[k] ^ y[i]]));
         }
-        if (dn > 0) {
-            pn = 0;
-            for (i = 0; i < ps && pn < dn; i++) {
-                if (!fec_marks[i]) {
-                    //got valid fec row
-                    fec_block_nos[pn] = i;
-                    dec_fec_blocks[pn] = fec_blocks[i];
-                    pn++;
-                }
-            }
+    }
+
+    return 0;
+}
 
-            if (dn == pn) {
-                reed_solomon_decode(rs, data_blocks, block_size, dec_fec_blocks, fec_block_nos, erased_blocks, dn);
-            } else
-                err = -1;
+/**
+ * turn folded fec shards into the erased data shards in place
+ * input:
+ * lu: from reed_solomon_factor()
+ * blocks[nr_fec_blocks]: fec shard fec_block_nos[i] with every surviving
+ * data shard folded in on input, erased data shard erased_blocks[i] on output
+ * only [offset, block_size) is touched, so disjoint ranges
+ * can be solved from different threads at the same time
+ * */
+int reed_solomon_solve_in_place(unsigned char* lu, unsigned char** blocks, int nr_fec_blocks, int offset, int block_size) {
+    int n = nr_fec_blocks;
+    int i, k, start, size;
+
+    for (start = offset; start < block_size; start += CODE_BLOCK_SIZE) {
+        size = block_size - start;
+        if (size > CODE_BLOCK_SIZE)
+            size = CODE_BLOCK_SIZE;
+
+        /* forward substitution, L y = s */
+        for (i = 1; i < n; i++) {
+            for (k = 0; k < i; k++)
+                addmul(blocks[i] + start, blocks[k] + start, lu[i*n + k], size);
         }
-        data_blocks += ds;
-        marks += ds;
-        fec_blocks += ps;
-        fec_marks += ps;
+
+        /* back substitution, U d = y */
+        for (i = n-1; i >= 0; i--) {
+            for (k = i+1; k < n; k++)
+                addmul(blocks[i] + start, blocks[k] + start, lu[i*n + k], size);
+            mul(blocks[i] + start, blocks[i] + start, lu[i*n + i], size);
+        }
+    }
+
+    return 0;
+}
+
+#ifdef RS_GENERATE_TABLES
+static void print_table(const char* decl, const gf* table, int size) {
+    int i;
+
+    printf("%s = {", decl);
+    for (i = 0; i < size; i++)
+        printf("%s0x%02x,", (i % 16) ? " " : "\n    ", table[i]);
+    printf("\n};\n\n");
+}
+
+static void print_nibble_table(const char* decl, gf table[][16]) {
+    int i, j;
+
+    printf("%s = {\n", decl);
+    for (i = 0; i < GF_SIZE + 1; i++) {
+        printf("    {");
+        for (j = 0; j < 16; j++)
+            printf("%s0x%02x", j ? ", " : " ", table[i][j]);
+        printf(" },\n");
     }
+    printf("};\n\n");
+}
 
-    return err;
+int main(void) {
+    int i;
+
+    generate_gf();
+    init_mul_table();
+
+    printf("/* generated by building rs.c with RS_GENERATE_TABLES, do not edit */\n\n");
+
+    print_table("static const gf gf_exp[2*GF_SIZE]", gf_exp, 2*GF_SIZE);
+
+    printf("static const int gf_log[GF_SIZE + 1] = {");
+    for (i = 0; i < GF_SIZE + 1; i++)
+        printf("%s%d,", (i % 16) ? " " : "\n    ", gf_log[i]);
+    printf("\n};\n\n");
+
+    print_table("static const gf inverse[GF_SIZE+1]", inverse, GF_SIZE + 1);
+    print_table("static const gf gf_mul_table[(GF_SIZE + 1)*(GF_SIZE + 1)] __attribute__((aligned (256)))",
+                gf_mul_table, (GF_SIZE + 1)*(GF_SIZE + 1));
+    print_nibble_table("static const gf gf_mul_lo[GF_SIZE + 1][16] __attribute__((aligned (64)))", gf_mul_lo);
+    print_nibble_table("static const gf gf_mul_hi[GF_SIZE + 1][16] __attribute__((aligned (64)))", gf_mul_hi);
+
+    return 0;
 }
+#endif
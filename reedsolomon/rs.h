@@ -30,13 +30,25 @@ void reed_solomon_release(reed_solomon* rs);
 int reed_solomon_encode(reed_solomon* rs, unsigned char** shards, int nr_shards, int block_size);
 
 /**
- * reconstruct a big size of buffer
- * input:
- * rs
- * nr_shards: assert(0 == nr_shards % rs->data_shards)
- * shards[nr_shards][block_size]
- * marks[nr_shards] marks as errors
+ * fold a data shard into a fec shard, for decoding as shards arrive
+ * fec_block[offset, block_size) ^= coefficient * data_block[offset, block_size)
+ * */
+int reed_solomon_fold(reed_solomon* rs, unsigned char* fec_block, int fec_block_no, unsigned char* data_block, int data_block_no, int offset, int block_size);
+
+/**
+ * LU factor the fec rows used against the erased data shards
+ * fec_block_nos, erased_blocks: nr_fec_blocks of each
+ * lu[nr_fec_blocks*nr_fec_blocks]: receives the factors
+ * */
+int reed_solomon_factor(reed_solomon* rs, unsigned int *fec_block_nos, unsigned int *erased_blocks, int nr_fec_blocks, unsigned char* lu);
+
+/**
+ * recover erased data shards in place from fec shards that every surviving
+ * data shard has been folded into with reed_solomon_fold()
+ * blocks[i] holds fec shard fec_block_nos[i] on input, erased_blocks[i] on output
+ * only [offset, block_size) is touched, so disjoint ranges
+ * can be solved from different threads at the same time
  * */
-int reed_solomon_reconstruct(reed_solomon* rs, unsigned char** shards, unsigned char* marks, int nr_shards, int block_size);
+int reed_solomon_solve_in_place(unsigned char* lu, unsigned char** blocks, int nr_fec_blocks, int offset, int block_size);
 #endif
 
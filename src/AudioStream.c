@@ -3,6 +3,7 @@
 #include "PlatformThreads.h"
 #include "LinkedBlockingQueue.h"
 #include "RtpReorderQueue.h"
+#include "EventLoop.h"
 
 static SOCKET rtpSocket = INVALID_SOCKET;
 
@@ -13,10 +14,15 @@ static PLT_THREAD udpPingThread;
 static PLT_THREAD receiveThread;
 static PLT_THREAD decoderThread;
 
+// Receive and ping on the shared event loop instead of our own threads
+static int useEventLoop;
+
 static unsigned short lastSeq;
 
 #define RTP_PORT 48000
 
+#define UDP_PING_INTERVAL_MS 500
+
 #define MAX_PACKET_SIZE 250
 
 // This is much larger than we should typically have buffered, but
@@ -24,6 +30,9 @@ static unsigned short lastSeq;
 // for longer than normal.
 #define RTP_RECV_BUFFER (64 * 1024)
 
+// Packets kept posted to the kernel when it receives into them itself
+#define RTP_RING_BUFFERS 32
+
 #define SAMPLE_RATE 48000
 
 static OPUS_MULTISTREAM_CONFIGURATION opusStereoConfig = {
@@ -58,6 +67,12 @@ typedef struct _QUEUED_AUDIO_PACKET {
     } q;
 } QUEUED_AUDIO_PACKET, *PQUEUED_AUDIO_PACKET;
 
+// Packet for the next receive, kept across calls
+static PQUEUED_AUDIO_PACKET receiveBuffer;
+
+// Set if the kernel receives straight into our packets
+static PUDP_RING receiveRing;
+
 // Initialize the audio stream
 void initializeAudioStream(void) {
     if ((AudioCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
@@ -88,7 +103,8 @@ void destroyAudioStream(void) {
     RtpqCleanupQueue(&rtpReorderQueue);
 }
 
-static void UdpPingThreadProc(void* context) {
+// Sends one ping. Returns non-zero if the stream should stop pinging.
+static int sendPing(void) {
     // Ping in ASCII
     char pingData[] = { 0x50, 0x49, 0x4E, 0x47 };
     struct sockaddr_in6 saddr;
@@ -97,19 +113,31 @@ static void UdpPingThreadProc(void* context) {
     memcpy(&saddr, &RemoteAddr, sizeof(saddr));
     saddr.sin6_port = htons(RTP_PORT);
 
+    err = sendto(rtpSocket, pingData, sizeof(pingData), 0, (struct sockaddr*)&saddr, RemoteAddrLen);
+    if (err != sizeof(pingData)) {
+        Limelog("Audio Ping: sendto() failed: %d\n", (int)LastSocketError());
+        ListenerCallbacks.connectionTerminated(LastSocketError());
+        return -1;
+    }
+
+    return 0;
+}
+
+static void UdpPingThreadProc(void* context) {
     // Send PING every 500 milliseconds
     while (!PltIsThreadInterrupted(&udpPingThread)) {
-        err = sendto(rtpSocket, pingData, sizeof(pingData), 0, (struct sockaddr*)&saddr, RemoteAddrLen);
-        if (err != sizeof(pingData)) {
-            Limelog("Audio Ping: sendto() failed: %d\n", (int)LastSocketError());
-            ListenerCallbacks.connectionTerminated(LastSocketError());
+        if (sendPing() != 0) {
             return;
         }
 
-        PltSleepMs(500);
+        PltSleepMs(UDP_PING_INTERVAL_MS);
     }
 }
 
+static int UdpPingTimerProc(void* context) {
+    return sendPing();
+}
+
 static int queuePacketToLbq(PQUEUED_AUDIO_PACKET* packet) {
     int err;
 
@@ -144,91 +172,215 @@ static void decodeInputData(PQUEUED_AUDIO_PACKET packet) {
     AudioCallbacks.decodeAndPlaySample((char*)(rtp + 1), packet->size - sizeof(*rtp));
 }
 
-static void ReceiveThreadProc(void* context) {
+// Receives one packet, waiting for it if wait is set.
+// Returns non-zero if the stream should stop receiving.
+static int receivePacket(int wait) {
     PRTP_PACKET rtp;
     PQUEUED_AUDIO_PACKET packet;
+    char* buffer;
+    int length;
     int queueStatus;
+    int err;
+    int ret;
 
-    packet = NULL;
+    packet = receiveBuffer;
+    ret = 0;
 
-    while (!PltIsThreadInterrupted(&receiveThread)) {
+    if (receiveRing != NULL) {
+        // The ring takes back the packet we kept and hands us a filled one
+        buffer = (char*)packet;
+        err = recvUdpRing(receiveRing, &buffer, &length, NULL, 1);
+        packet = (PQUEUED_AUDIO_PACKET)buffer;
+    }
+    else {
         if (packet == NULL) {
             packet = (PQUEUED_AUDIO_PACKET)malloc(sizeof(*packet));
             if (packet == NULL) {
                 Limelog("Audio Receive: malloc() failed\n");
                 ListenerCallbacks.connectionTerminated(-1);
-                break;
+                ret = -1;
+                goto Exit;
             }
         }
 
-        packet->size = recvUdpSocket(rtpSocket, &packet->data[0], MAX_PACKET_SIZE);
-        if (packet->size < 0) {
-            Limelog("Audio Receive: recvUdpSocket() failed: %d\n", (int)LastSocketError());
-            ListenerCallbacks.connectionTerminated(LastSocketError());
-            break;
+        buffer = &packet->data[0];
+        if (wait) {
+            err = recvUdpSocketBatch(rtpSocket, &buffer, &length, NULL, MAX_PACKET_SIZE, 1);
         }
-        else if (packet->size == 0) {
-            // Receive timed out; try again
-            continue;
+        else {
+            err = readUdpSocketBatch(rtpSocket, &buffer, &length, NULL, MAX_PACKET_SIZE, 1);
         }
+    }
+    if (err < 0) {
+        Limelog("Audio Receive: recvUdpSocketBatch() failed: %d\n", (int)LastSocketError());
+        ListenerCallbacks.connectionTerminated(LastSocketError());
+        ret = -1;
+        goto Exit;
+    }
+    else if (err == 0 || length == 0) {
+        // Receive timed out; try again
+        goto Exit;
+    }
 
-        if (packet->size < sizeof(RTP_PACKET)) {
-            // Runt packet
-            continue;
-        }
+    packet->size = length;
 
-        rtp = (PRTP_PACKET)&packet->data[0];
-        if (rtp->packetType != 97) {
-            // Not audio
-            continue;
-        }
+    if (packet->size < sizeof(RTP_PACKET)) {
+        // Runt packet
+        goto Exit;
+    }
 
-        // RTP sequence number must be in host order for the RTP queue
-        rtp->sequenceNumber = htons(rtp->sequenceNumber);
+    rtp = (PRTP_PACKET)&packet->data[0];
+    if (rtp->packetType != 97) {
+        // Not audio
+        goto Exit;
+    }
 
-        queueStatus = RtpqAddPacket(&rtpReorderQueue, (PRTP_PACKET)packet, &packet->q.rentry);
-        if (queueStatus == RTPQ_RET_HANDLE_IMMEDIATELY) {
-            if ((AudioCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
-                if (!queuePacketToLbq(&packet)) {
-                    // An exit signal was received
-                    break;
-                }
-            }
-            else {
-                decodeInputData(packet);
+    // RTP sequence number must be in host order for the RTP queue
+    rtp->sequenceNumber = htons(rtp->sequenceNumber);
+
+    queueStatus = RtpqAddPacket(&rtpReorderQueue, (PRTP_PACKET)packet, &packet->q.rentry);
+    if (queueStatus == RTPQ_RET_HANDLE_IMMEDIATELY) {
+        if ((AudioCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
+            if (!queuePacketToLbq(&packet)) {
+                // An exit signal was received
+                ret = -1;
             }
         }
         else {
-            if (queueStatus != RTPQ_RET_REJECTED) {
-                // The queue consumed our packet, so we must allocate a new one
-                packet = NULL;
-            }
+            decodeInputData(packet);
+        }
+    }
+    else {
+        if (queueStatus != RTPQ_RET_REJECTED) {
+            // The queue consumed our packet, so we must allocate a new one
+            packet = NULL;
+        }
 
-            if (queueStatus == RTPQ_RET_QUEUED_PACKETS_READY) {
-                // If packets are ready, pull them and send them to the decoder
-                while ((packet = (PQUEUED_AUDIO_PACKET)RtpqGetQueuedPacket(&rtpReorderQueue)) != NULL) {
-                    if ((AudioCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
-                        if (!queuePacketToLbq(&packet)) {
-                            // An exit signal was received
-                            break;
-                        }
-                    }
-                    else {
-                        decodeInputData(packet);
-                        free(packet);
+        if (queueStatus == RTPQ_RET_QUEUED_PACKETS_READY) {
+            // If packets are ready, pull them and send them to the decoder
+            while ((packet = (PQUEUED_AUDIO_PACKET)RtpqGetQueuedPacket(&rtpReorderQueue)) != NULL) {
+                if ((AudioCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
+                    if (!queuePacketToLbq(&packet)) {
+                        // An exit signal was received
+                        ret = -1;
+                        break;
                     }
                 }
-                
-                // Break on exit
-                if (packet != NULL) {
-                    break;
+                else {
+                    decodeInputData(packet);
+                    free(packet);
                 }
             }
         }
     }
-    
-    if (packet != NULL) {
-        free(packet);
+
+Exit:
+    receiveBuffer = packet;
+    return ret;
+}
+
+static void ReceiveThreadProc(void* context) {
+    while (!PltIsThreadInterrupted(&receiveThread)) {
+        if (receivePacket(1) != 0) {
+            break;
+        }
+    }
+}
+
+static int ReceiveReadableProc(void* context) {
+    return receivePacket(0);
+}
+
+static void* allocRingBuffer(void* context) {
+    return malloc(sizeof(QUEUED_AUDIO_PACKET));
+}
+
+static void freeRingBuffer(void* context, void* buffer) {
+    free(buffer);
+}
+
+static int startReceiving(void) {
+    int err;
+
+    if (!useEventLoop) {
+        // This is NULL where the kernel can't receive into our buffers itself
+        receiveRing = createUdpRing(rtpSocket, MAX_PACKET_SIZE, RTP_RING_BUFFERS,
+                                    allocRingBuffer, freeRingBuffer, NULL);
+
+        err = PltCreateThread(THREAD_ROLE_AUDIO_RECEIVE, ReceiveThreadProc, NULL, &receiveThread);
+        if (err != 0 && receiveRing != NULL) {
+            destroyUdpRing(receiveRing);
+            receiveRing = NULL;
+        }
+
+        return err;
+    }
+
+    err = ElStartEventLoop();
+    if (err != 0) {
+        return err;
+    }
+
+    err = ElAddSocket(rtpSocket, ReceiveReadableProc, NULL);
+    if (err != 0) {
+        ElStopEventLoop();
+        return err;
+    }
+
+    return 0;
+}
+
+static void stopReceiving(void) {
+    if (useEventLoop) {
+        ElRemoveSocket(rtpSocket);
+        ElStopEventLoop();
+    }
+    else {
+        PltInterruptThread(&receiveThread);
+        PltJoinThread(&receiveThread);
+        PltCloseThread(&receiveThread);
+    }
+
+    if (receiveBuffer != NULL) {
+        free(receiveBuffer);
+        receiveBuffer = NULL;
+    }
+    if (receiveRing != NULL) {
+        destroyUdpRing(receiveRing);
+        receiveRing = NULL;
+    }
+}
+
+static int startPinging(void) {
+    int err;
+
+    if (!useEventLoop) {
+        return PltCreateThread(THREAD_ROLE_AUDIO_PING, UdpPingThreadProc, NULL, &udpPingThread);
+    }
+
+    err = ElStartEventLoop();
+    if (err != 0) {
+        return err;
+    }
+
+    err = ElAddTimer(UDP_PING_INTERVAL_MS, UdpPingTimerProc, NULL);
+    if (err != 0) {
+        ElStopEventLoop();
+        return err;
+    }
+
+    return 0;
+}
+
+static void stopPinging(void) {
+    if (useEventLoop) {
+        ElRemoveTimer(UdpPingTimerProc, NULL);
+        ElStopEventLoop();
+    }
+    else {
+        PltInterruptThread(&udpPingThread);
+        PltJoinThread(&udpPingThread);
+        PltCloseThread(&udpPingThread);
     }
 }
 
@@ -252,23 +404,16 @@ static void DecoderThreadProc(void* context) {
 void stopAudioStream(void) {
     AudioCallbacks.stop();
 
-    PltInterruptThread(&udpPingThread);
-    PltInterruptThread(&receiveThread);
     if ((AudioCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {        
         // Signal threads waiting on the LBQ
         LbqSignalQueueShutdown(&packetQueue);
         PltInterruptThread(&decoderThread);
     }
     
-    PltJoinThread(&udpPingThread);
-    PltJoinThread(&receiveThread);
+    stopPinging();
+    stopReceiving();
     if ((AudioCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
         PltJoinThread(&decoderThread);
-    }
-
-    PltCloseThread(&udpPingThread);
-    PltCloseThread(&receiveThread);
-    if ((AudioCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
         PltCloseThread(&decoderThread);
     }
     
@@ -283,6 +428,9 @@ void stopAudioStream(void) {
 int startAudioStream(void* audioContext, int arFlags) {
     int err;
 
+    // Platforms without an event loop fall back to per-stream threads
+    useEventLoop = StreamConfig.useEventLoop && ElIsSupported();
+
     err = AudioCallbacks.init(StreamConfig.audioConfiguration,
         opusConfigArray[StreamConfig.audioConfiguration], audioContext, arFlags);
     if (err != 0) {
@@ -296,7 +444,7 @@ int startAudioStream(void* audioContext, int arFlags) {
         return err;
     }
 
-    err = PltCreateThread(UdpPingThreadProc, NULL, &udpPingThread);
+    err = startPinging();
     if (err != 0) {
         AudioCallbacks.cleanup();
         closeSocket(rtpSocket);
@@ -305,27 +453,21 @@ int startAudioStream(void* audioContext, int arFlags) {
 
     AudioCallbacks.start();
 
-    err = PltCreateThread(ReceiveThreadProc, NULL, &receiveThread);
+    err = startReceiving();
     if (err != 0) {
         AudioCallbacks.stop();
-        PltInterruptThread(&udpPingThread);
-        PltJoinThread(&udpPingThread);
-        PltCloseThread(&udpPingThread);
+        stopPinging();
         closeSocket(rtpSocket);
         AudioCallbacks.cleanup();
         return err;
     }
 
     if ((AudioCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
-        err = PltCreateThread(DecoderThreadProc, NULL, &decoderThread);
+        err = PltCreateThread(THREAD_ROLE_AUDIO_DECODER, DecoderThreadProc, NULL, &decoderThread);
         if (err != 0) {
             AudioCallbacks.stop();
-            PltInterruptThread(&udpPingThread);
-            PltInterruptThread(&receiveThread);
-            PltJoinThread(&udpPingThread);
-            PltJoinThread(&receiveThread);
-            PltCloseThread(&udpPingThread);
-            PltCloseThread(&receiveThread);
+            stopPinging();
+            stopReceiving();
             closeSocket(rtpSocket);
             AudioCallbacks.cleanup();
             return err;
@@ -0,0 +1,122 @@
+#include "Limelight-internal.h"
+#include "BufferPool.h"
+
+// Buffer pool init. If the slab can't be allocated, the pool still works
+// but hands out every buffer from the heap.
+int BpInitializePool(PBUFFER_POOL pool, int bufferSize, int bufferCount) {
+    int err;
+    int i;
+
+    memset(pool, 0, sizeof(*pool));
+
+    err = PltCreateMutex(&pool->mutex);
+    if (err != 0) {
+        return err;
+    }
+
+    pool->bufferSize = bufferSize;
+    pool->stride = (bufferSize + BP_ALIGNMENT - 1) & ~(BP_ALIGNMENT - 1);
+
+    if (bufferCount > 0) {
+        pool->slabAllocation = malloc((size_t)pool->stride * bufferCount + BP_ALIGNMENT - 1);
+    }
+    if (pool->slabAllocation == NULL) {
+        if (bufferCount > 0) {
+            Limelog("Buffer pool: malloc() failed; falling back to heap buffers\n");
+        }
+        return 0;
+    }
+
+    pool->slab = (char*)(((uintptr_t)pool->slabAllocation + BP_ALIGNMENT - 1) & ~(uintptr_t)(BP_ALIGNMENT - 1));
+    pool->slabEnd = pool->slab + (size_t)pool->stride * bufferCount;
+    pool->bufferCount = bufferCount;
+
+    // Thread the free list through the slab in address order
+    for (i = bufferCount - 1; i >= 0; i--) {
+        void** buffer = (void**)(pool->slab + (size_t)pool->stride * i);
+        *buffer = pool->freeList;
+        pool->freeList = buffer;
+    }
+    pool->freeCount = bufferCount;
+
+    return 0;
+}
+
+// Buffers must all have been returned to the pool before it is destroyed
+void BpDestroyPool(PBUFFER_POOL pool) {
+    LC_ASSERT(pool->freeCount == pool->bufferCount);
+
+    if (pool->fallbackAllocations != 0) {
+        Limelog("Buffer pool: %llu buffers allocated from the heap\n", pool->fallbackAllocations);
+    }
+
+    free(pool->slabAllocation);
+    pool->slabAllocation = NULL;
+    pool->slab = NULL;
+    pool->slabEnd = NULL;
+    pool->freeList = NULL;
+
+    PltDeleteMutex(&pool->mutex);
+}
+
+// Heap buffers are aligned like pooled ones, with the allocation they were
+// carved from stored just before them
+static void* allocHeapBuffer(PBUFFER_POOL pool) {
+    char* allocation;
+    void** buffer;
+
+    allocation = (char*)malloc(pool->bufferSize + sizeof(void*) + BP_ALIGNMENT - 1);
+    if (allocation == NULL) {
+        return NULL;
+    }
+
+    buffer = (void**)(((uintptr_t)allocation + sizeof(void*) + BP_ALIGNMENT - 1) & ~(uintptr_t)(BP_ALIGNMENT - 1));
+    buffer[-1] = allocation;
+    return buffer;
+}
+
+// Returns NULL only if the pool is empty and the heap is too
+void* BpAllocBuffer(PBUFFER_POOL pool) {
+    void** buffer;
+
+    PltLockMutex(&pool->mutex);
+
+    buffer = (void**)pool->freeList;
+    if (buffer != NULL) {
+        pool->freeList = *buffer;
+        pool->freeCount--;
+    }
+    else {
+        pool->fallbackAllocations++;
+    }
+
+    PltUnlockMutex(&pool->mutex);
+
+    if (buffer == NULL) {
+        buffer = (void**)allocHeapBuffer(pool);
+    }
+
+    return buffer;
+}
+
+void BpFreeBuffer(PBUFFER_POOL pool, void* buffer) {
+    if (buffer == NULL) {
+        return;
+    }
+
+    // Buffers from outside the slab came from the heap
+    if ((char*)buffer < pool->slab || (char*)buffer >= pool->slabEnd) {
+        free(((void**)buffer)[-1]);
+        return;
+    }
+
+    LC_ASSERT(((char*)buffer - pool->slab) % pool->stride == 0);
+
+    PltLockMutex(&pool->mutex);
+
+    *(void**)buffer = pool->freeList;
+    pool->freeList = buffer;
+    pool->freeCount++;
+
+    PltUnlockMutex(&pool->mutex);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "PlatformThreads.h"
+
+// Buffers in the pool start on cache line boundaries
+#define BP_ALIGNMENT 64
+
+typedef struct _BUFFER_POOL {
+    PLT_MUTEX mutex;
+
+    // Every pooled buffer is carved out of a single allocation
+    void* slabAllocation;
+    char* slab;
+    char* slabEnd;
+    int stride;
+    int bufferSize;
+    int bufferCount;
+
+    // Free pooled buffers, linked through their first bytes
+    void* freeList;
+    int freeCount;
+
+    // Buffers handed out from the heap while the pool was empty
+    unsigned long long fallbackAllocations;
+} BUFFER_POOL, *PBUFFER_POOL;
+
+int BpInitializePool(PBUFFER_POOL pool, int bufferSize, int bufferCount);
+void BpDestroyPool(PBUFFER_POOL pool);
+void* BpAllocBuffer(PBUFFER_POOL pool);
+void BpFreeBuffer(PBUFFER_POOL pool, void* buffer);
@@ -40,6 +40,27 @@ const char* LiGetStageName(int stage) {
     return stageNames[stage];
 }
 
+// Thread roles, short enough to be thread names on every platform
+static const char* threadRoleNames[THREAD_ROLE_MAX] = {
+    "VideoReceive",
+    "VideoDecoder",
+    "VideoPing",
+    "AudioReceive",
+    "AudioDecoder",
+    "AudioPing",
+    "FecWorker",
+    "EventLoop",
+    "LossStats",
+    "InvalidateRefs",
+    "InputSend",
+    "TermCallback"
+};
+
+// Get the name of a thread role based on its number
+const char* LiGetThreadRoleName(int role) {
+    return threadRoleNames[role];
+}
+
 // Interrupt a pending connection attempt. This interruption happens asynchronously
 // so it is not safe to start another connection before LiStartConnection() returns.
 void LiInterruptConnection(void) {
@@ -149,7 +170,7 @@ static void ClInternalConnectionTerminated(long errorCode)
     alreadyTerminated = 1;
 
     // Invoke the termination callback on a separate thread
-    err = PltCreateThread(terminationCallbackThreadFunc, NULL, &terminationCallbackThread);
+    err = PltCreateThread(THREAD_ROLE_TERMINATION_CALLBACK, terminationCallbackThreadFunc, NULL, &terminationCallbackThread);
     if (err != 0) {
         // Nothing we can safely do here, so we'll just assert on debug builds
         Limelog("Failed to create termination thread: %d\n", err);
@@ -33,6 +33,12 @@ static PLT_EVENT invalidateRefFramesEvent;
 static int lossCountSinceLastReport;
 static long lastGoodFrame;
 static long lastSeenFrame;
+// Frames recently reported lost, slotted by frame number. Losses aren't always
+// reported in frame order, since the FEC queue can give up on a frame while an
+// older one is still waiting on its deadline.
+#define LOST_FRAME_HISTORY 128
+static int reportedLostFrames[LOST_FRAME_HISTORY];
+
 static int stopping;
 
 static int idrFrameRequired;
@@ -147,6 +153,8 @@ static char**preconstructedPayloads;
 
 // Initializes the control stream
 int initializeControlStream(void) {
+    int i;
+
     stopping = 0;
     PltCreateEvent(&invalidateRefFramesEvent);
     LbqInitializeLinkedBlockingQueue(&invalidReferenceFrameTuples, 20);
@@ -176,6 +184,9 @@ int initializeControlStream(void) {
     idrFrameRequired = 0;
     lastGoodFrame = 0;
     lastSeenFrame = 0;
+    for (i = 0; i < LOST_FRAME_HISTORY; i++) {
+        reportedLostFrames[i] = -1;
+    }
     lossCountSinceLastReport = 0;
 
     return 0;
@@ -239,7 +250,27 @@ void requestIdrOnDemand(void) {
 
 // Invalidate reference frames lost by the network
 void connectionDetectedFrameLoss(int startFrame, int endFrame) {
-    queueFrameInvalidationTuple(startFrame, endFrame);
+    int frame = startFrame;
+
+    // The FEC queue reports frames as soon as it gives up on them and the
+    // depacketizer reports them again later, so only report the runs of
+    // frames in this range that haven't been already
+    while (!isBeforeSignedInt(endFrame, frame, 0)) {
+        int runStart = frame;
+
+        while (!isBeforeSignedInt(endFrame, frame, 0) &&
+               reportedLostFrames[(unsigned int)frame % LOST_FRAME_HISTORY] != frame) {
+            reportedLostFrames[(unsigned int)frame % LOST_FRAME_HISTORY] = frame;
+            frame++;
+        }
+
+        if (frame != runStart) {
+            queueFrameInvalidationTuple(runStart, frame - 1);
+        }
+        else {
+            frame++;
+        }
+    }
 }
 
 // When we receive a frame, update the number of our current frame
@@ -704,7 +735,7 @@ int startControlStream(void) {
         return err;
     }
 
-    err = PltCreateThread(lossStatsThreadFunc, NULL, &lossStatsThread);
+    err = PltCreateThread(THREAD_ROLE_LOSS_STATS, lossStatsThreadFunc, NULL, &lossStatsThread);
     if (err != 0) {
         stopping = 1;
         if (ctlSock != INVALID_SOCKET) {
@@ -720,7 +751,7 @@ int startControlStream(void) {
         return err;
     }
 
-    err = PltCreateThread(invalidateRefFramesFunc, NULL, &invalidateRefFramesThread);
+    err = PltCreateThread(THREAD_ROLE_INVALIDATE_REF_FRAMES, invalidateRefFramesFunc, NULL, &invalidateRefFramesThread);
     if (err != 0) {
         stopping = 1;
 
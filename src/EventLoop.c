@@ -0,0 +1,303 @@
+#include "Limelight-internal.h"
+#include "EventLoop.h"
+
+#if defined(__linux__) && !defined(LC_CHROME)
+#define HAVE_EPOLL
+#endif
+
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+
+typedef struct _EL_SOCKET {
+    SOCKET s;
+    EventLoopHandler handler;
+    void* context;
+} EL_SOCKET, *PEL_SOCKET;
+
+typedef struct _EL_TIMER {
+    int periodMs;
+    uint64_t nextRunMs;
+    EventLoopHandler handler;
+    void* context;
+} EL_TIMER, *PEL_TIMER;
+
+// Streams that are using the loop
+static int users;
+
+static PLT_THREAD loopThread;
+static PLT_MUTEX loopMutex;
+static int epollFd = -1;
+
+// Free entries have a NULL handler
+static EL_SOCKET sockets[EL_MAX_SOCKETS];
+static EL_TIMER timers[EL_MAX_TIMERS];
+
+// Must be called with the loop mutex held
+static void removeSocketAt(int i) {
+    struct epoll_event event;
+
+    // Kernels before 2.6.9 want a non-NULL event even for EPOLL_CTL_DEL
+    memset(&event, 0, sizeof(event));
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, sockets[i].s, &event);
+    sockets[i].s = INVALID_SOCKET;
+    sockets[i].handler = NULL;
+}
+
+// Runs due timers and returns how long to wait for the next one.
+// Must be called with the loop mutex held.
+static int runTimers(void) {
+    uint64_t now;
+    int timeoutMs;
+    int i;
+
+    now = PltGetMillis();
+    timeoutMs = EL_POLL_INTERVAL_MS;
+    for (i = 0; i < EL_MAX_TIMERS; i++) {
+        if (timers[i].handler == NULL) {
+            continue;
+        }
+
+        if (timers[i].nextRunMs <= now) {
+            // Don't try to catch up on runs we were too busy for
+            timers[i].nextRunMs = now + timers[i].periodMs;
+            if (timers[i].handler(timers[i].context) != 0) {
+                timers[i].handler = NULL;
+                continue;
+            }
+        }
+
+        if ((int)(timers[i].nextRunMs - now) < timeoutMs) {
+            timeoutMs = (int)(timers[i].nextRunMs - now);
+        }
+    }
+
+    return timeoutMs;
+}
+
+static void EventLoopThreadProc(void* context) {
+    struct epoll_event events[EL_MAX_SOCKETS];
+    int timeoutMs;
+    int count;
+    int i;
+
+    PltLockMutex(&loopMutex);
+    timeoutMs = runTimers();
+    PltUnlockMutex(&loopMutex);
+
+    while (!PltIsThreadInterrupted(&loopThread)) {
+        count = epoll_wait(epollFd, events, EL_MAX_SOCKETS, timeoutMs);
+        if (count < 0 && errno != EINTR) {
+            Limelog("Event loop: epoll_wait() failed: %d\n", errno);
+            ListenerCallbacks.connectionTerminated(errno);
+            return;
+        }
+
+        PltLockMutex(&loopMutex);
+
+        for (i = 0; i < count; i++) {
+            PEL_SOCKET entry = &sockets[events[i].data.u32];
+
+            // The socket may have been removed by an earlier handler
+            if (entry->handler != NULL && entry->handler(entry->context) != 0) {
+                removeSocketAt(events[i].data.u32);
+            }
+        }
+
+        timeoutMs = runTimers();
+
+        PltUnlockMutex(&loopMutex);
+    }
+}
+
+int ElIsSupported(void) {
+    return 1;
+}
+
+// Starts the loop thread for the first user
+int ElStartEventLoop(void) {
+    int err;
+    int i;
+
+    if (users++ > 0) {
+        return 0;
+    }
+
+    for (i = 0; i < EL_MAX_SOCKETS; i++) {
+        sockets[i].s = INVALID_SOCKET;
+        sockets[i].handler = NULL;
+    }
+    for (i = 0; i < EL_MAX_TIMERS; i++) {
+        timers[i].handler = NULL;
+    }
+
+    epollFd = epoll_create(EL_MAX_SOCKETS);
+    if (epollFd < 0) {
+        err = errno;
+        Limelog("Event loop: epoll_create() failed: %d\n", err);
+        goto Fail;
+    }
+
+    err = PltCreateMutex(&loopMutex);
+    if (err != 0) {
+        close(epollFd);
+        goto Fail;
+    }
+
+    err = PltCreateThread(THREAD_ROLE_EVENT_LOOP, EventLoopThreadProc, NULL, &loopThread);
+    if (err != 0) {
+        PltDeleteMutex(&loopMutex);
+        close(epollFd);
+        goto Fail;
+    }
+
+    return 0;
+
+Fail:
+    epollFd = -1;
+    users = 0;
+    return err;
+}
+
+// Stops the loop thread once its last user is done with it
+void ElStopEventLoop(void) {
+    LC_ASSERT(users > 0);
+    if (--users > 0) {
+        return;
+    }
+
+    PltInterruptThread(&loopThread);
+    PltJoinThread(&loopThread);
+    PltCloseThread(&loopThread);
+
+    PltDeleteMutex(&loopMutex);
+    close(epollFd);
+    epollFd = -1;
+}
+
+// Calls handler on the loop thread whenever s is readable
+int ElAddSocket(SOCKET s, EventLoopHandler handler, void* context) {
+    struct epoll_event event;
+    int err;
+    int i;
+
+    LC_ASSERT(users > 0);
+
+    PltLockMutex(&loopMutex);
+
+    for (i = 0; i < EL_MAX_SOCKETS; i++) {
+        if (sockets[i].handler == NULL) {
+            break;
+        }
+    }
+    if (i == EL_MAX_SOCKETS) {
+        PltUnlockMutex(&loopMutex);
+        return -1;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = i;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, s, &event) < 0) {
+        err = errno;
+        Limelog("Event loop: epoll_ctl() failed: %d\n", err);
+        PltUnlockMutex(&loopMutex);
+        return err;
+    }
+
+    sockets[i].s = s;
+    sockets[i].context = context;
+    sockets[i].handler = handler;
+
+    PltUnlockMutex(&loopMutex);
+    return 0;
+}
+
+// Once this returns, the socket's handler isn't running and won't run again
+void ElRemoveSocket(SOCKET s) {
+    int i;
+
+    PltLockMutex(&loopMutex);
+
+    for (i = 0; i < EL_MAX_SOCKETS; i++) {
+        if (sockets[i].handler != NULL && sockets[i].s == s) {
+            removeSocketAt(i);
+        }
+    }
+
+    PltUnlockMutex(&loopMutex);
+}
+
+// Calls handler on the loop thread every periodMs, starting on its next pass
+int ElAddTimer(int periodMs, EventLoopHandler handler, void* context) {
+    int i;
+
+    LC_ASSERT(users > 0);
+
+    PltLockMutex(&loopMutex);
+
+    for (i = 0; i < EL_MAX_TIMERS; i++) {
+        if (timers[i].handler == NULL) {
+            timers[i].periodMs = periodMs;
+            timers[i].nextRunMs = 0;
+            timers[i].context = context;
+            timers[i].handler = handler;
+            break;
+        }
+    }
+
+    PltUnlockMutex(&loopMutex);
+
+    return i == EL_MAX_TIMERS ? -1 : 0;
+}
+
+// Once this returns, the timer's handler isn't running and won't run again
+void ElRemoveTimer(EventLoopHandler handler, void* context) {
+    int i;
+
+    PltLockMutex(&loopMutex);
+
+    for (i = 0; i < EL_MAX_TIMERS; i++) {
+        if (timers[i].handler == handler && timers[i].context == context) {
+            timers[i].handler = NULL;
+        }
+    }
+
+    PltUnlockMutex(&loopMutex);
+}
+
+#else
+
+// Platforms without epoll run each stream on its own threads
+
+int ElIsSupported(void) {
+    return 0;
+}
+
+int ElStartEventLoop(void) {
+    LC_ASSERT(0);
+    return -1;
+}
+
+void ElStopEventLoop(void) {
+    LC_ASSERT(0);
+}
+
+int ElAddSocket(SOCKET s, EventLoopHandler handler, void* context) {
+    LC_ASSERT(0);
+    return -1;
+}
+
+void ElRemoveSocket(SOCKET s) {
+    LC_ASSERT(0);
+}
+
+int ElAddTimer(int periodMs, EventLoopHandler handler, void* context) {
+    LC_ASSERT(0);
+    return -1;
+}
+
+void ElRemoveTimer(EventLoopHandler handler, void* context) {
+    LC_ASSERT(0);
+}
+
+#endif
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "PlatformSockets.h"
+#include "PlatformThreads.h"
+
+// Runs on the event loop thread. Return non-zero to be unregistered.
+typedef int(*EventLoopHandler)(void* context);
+
+// Most sockets and timers that can be registered at once
+#define EL_MAX_SOCKETS 4
+#define EL_MAX_TIMERS 4
+
+// Longest the loop waits before checking whether it was stopped
+#define EL_POLL_INTERVAL_MS 100
+
+// Streams use their own threads where this returns 0
+int ElIsSupported(void);
+
+// Each call to ElStartEventLoop() must be paired with an ElStopEventLoop()
+int ElStartEventLoop(void);
+void ElStopEventLoop(void);
+int ElAddSocket(SOCKET s, EventLoopHandler handler, void* context);
+void ElRemoveSocket(SOCKET s);
+int ElAddTimer(int periodMs, EventLoopHandler handler, void* context);
+void ElRemoveTimer(EventLoopHandler handler, void* context);
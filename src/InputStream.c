@@ -392,7 +392,7 @@ int startInputStream(void) {
         enableNoDelay(inputSock);
     }
 
-    err = PltCreateThread(inputSendThreadProc, NULL, &inputSendThread);
+    err = PltCreateThread(THREAD_ROLE_INPUT_SEND, inputSendThreadProc, NULL, &inputSendThread);
     if (err != 0) {
         if (inputSock != INVALID_SOCKET) {
             closeSocket(inputSock);
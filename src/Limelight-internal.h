@@ -43,9 +43,10 @@ int sendInputPacketOnControlStream(unsigned char* data, int length);
 
 int performRtspHandshake(void);
 
-void initializeVideoDepacketizer(int pktSize);
+void initializeVideoDepacketizer(int pktSize, PRTP_FEC_QUEUE queue, int packetCount);
 void destroyVideoDepacketizer(void);
-void processRtpPayload(PNV_VIDEO_PACKET videoPacket, int length, unsigned long long receiveTimeMs);
+void processRtpPayload(PNV_VIDEO_PACKET videoPacket, int length, unsigned long long receiveTimeNs,
+                       PRTPFEC_QUEUE_ENTRY queueEntry);
 void queueRtpPacket(PRTPFEC_QUEUE_ENTRY queueEntry);
 void stopVideoDepacketizer(void);
 void requestDecoderRefresh(void);
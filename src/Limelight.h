@@ -42,6 +42,29 @@ typedef struct _STREAM_CONFIGURATION {
     // in /launch and /resume requests.
     char remoteInputAesKey[16];
     char remoteInputAesIv[16];
+
+    // Number of additional threads used to recover large video frames
+    // with heavy packet loss in parallel. If unsure, set to 0 to recover
+    // all frames on the video receive thread.
+    int fecWorkerThreads;
+
+    // Set to non-zero to receive audio and video and send their pings
+    // on one shared I/O thread rather than two threads per stream.
+    // Only supported on Linux; other platforms ignore this.
+    int useEventLoop;
+
+    // Microseconds the video receive thread spins reading its socket before
+    // it sleeps waiting for packets, trading a CPU core for lower jitter.
+    // Set to 0 to always sleep. Only supported on Linux, and ignored
+    // when useEventLoop is set.
+    int videoBusyPollUs;
+
+    // Set to non-zero to have the kernel coalesce runs of video datagrams with
+    // UDP GRO. Each coalesced run is copied apart for the FEC queue, so this only
+    // pays off where the network driver actually coalesces the stream; otherwise
+    // batched receive is faster. Only supported on Linux, and ignored when video
+    // is received through io_uring.
+    int videoUdpGro;
 } STREAM_CONFIGURATION, *PSTREAM_CONFIGURATION;
 
 // Use this function to zero the stream configuration when allocated on the stack or heap
@@ -64,17 +87,31 @@ typedef struct _DECODE_UNIT {
     int frameNumber;
 
     // Receive time of first buffer
-    // NOTE: This will be populated from gettimeofday() if !HAVE_CLOCK_GETTIME and
-    // populated from clock_gettime(CLOCK_MONOTONIC) if HAVE_CLOCK_GETTIME
+    // NOTE: This will be populated from gettimeofday() if !HAVE_CLOCK_GETTIME,
+    // populated from clock_gettime(CLOCK_MONOTONIC) if HAVE_CLOCK_GETTIME, and
+    // populated from GetTickCount64() on Windows
     unsigned long long receiveTimeMs;
 
+    // Arrival times of the first and last packets of the frame in nanoseconds,
+    // taken from the kernel's receive timestamps where the platform has them.
+    // These use the same clock as receiveTimeMs, except on Windows where
+    // they're from QueryPerformanceCounter().
+    unsigned long long firstPacketReceiveTimeNs;
+    unsigned long long lastPacketReceiveTimeNs;
+
     // Length of the entire buffer chain in bytes
     int fullLength;
 
-    // Head of the buffer chain (never NULL)
+    // Head of the buffer chain (never NULL). The buffers are read-only unless
+    // CAPABILITY_CONTIGUOUS_DECODE_UNITS is set (see CAPABILITY_DIRECT_SUBMIT).
+    // They stay valid until the decode unit is freed.
     PLENTRY bufferList;
 } DECODE_UNIT, *PDECODE_UNIT;
 
+// Zeroed bytes following the data of a contiguous decode unit, which covers
+// the overread allowed by common bitstream parsers
+#define DECODE_UNIT_PADDING 64
+
 // Specifies that the audio stream should be encoded in stereo (default)
 #define AUDIO_CONFIGURATION_STEREO 0
 
@@ -94,6 +131,12 @@ typedef struct _DECODE_UNIT {
 // renderer is non-blocking. This flag is valid on both audio and video renderers.
 #define CAPABILITY_DIRECT_SUBMIT 0x1
 
+// NOTE: Unless CAPABILITY_CONTIGUOUS_DECODE_UNITS is set, the buffers of a video decode unit
+// point straight into the received packets. They are read-only: the FEC queue may still read
+// those packets to recover others, so a renderer that needs to modify the bitstream must copy
+// it first. The packets are held until the decode unit is freed, so decode units should be
+// freed promptly to keep the packet pool from running dry.
+
 // If set in the video renderer capabilities field, this flag specifies that the renderer
 // supports reference frame invalidation for AVC/H.264 streams. This flag is only valid on video renderers.
 // If using this feature, the bitstream may not be patched (changing num_ref_frames or max_dec_frame_buffering)
@@ -104,6 +147,12 @@ typedef struct _DECODE_UNIT {
 // supports reference frame invalidation for HEVC/H.265 streams. This flag is only valid on video renderers.
 #define CAPABILITY_REFERENCE_FRAME_INVALIDATION_HEVC 0x4
 
+// If set in the video renderer capabilities field, this flag specifies that each decode unit
+// should be assembled into one contiguous buffer. The bufferList will then always hold a single
+// entry with the entire frame, followed by DECODE_UNIT_PADDING zeroed bytes that are not included
+// in its length. This capability is only valid on video renderers.
+#define CAPABILITY_CONTIGUOUS_DECODE_UNITS 0x8
+
 // If set in the video renderer capabilities field, this macro specifies that the renderer
 // supports slicing to increase decoding performance. The parameter specifies the desired
 // number of slices per frame. This capability is only valid on video renderers.
@@ -235,6 +284,27 @@ typedef void(*ConnListenerDisplayTransientMessage)(const char* message);
 // This callback is invoked to log debug message
 typedef void(*ConnListenerLogMessage)(const char* format, ...);
 
+// Threads created by the library, by role
+#define THREAD_ROLE_VIDEO_RECEIVE 0
+#define THREAD_ROLE_VIDEO_DECODER 1
+#define THREAD_ROLE_VIDEO_PING 2
+#define THREAD_ROLE_AUDIO_RECEIVE 3
+#define THREAD_ROLE_AUDIO_DECODER 4
+#define THREAD_ROLE_AUDIO_PING 5
+#define THREAD_ROLE_FEC_WORKER 6
+#define THREAD_ROLE_EVENT_LOOP 7
+#define THREAD_ROLE_LOSS_STATS 8
+#define THREAD_ROLE_INVALIDATE_REF_FRAMES 9
+#define THREAD_ROLE_INPUT_SEND 10
+#define THREAD_ROLE_TERMINATION_CALLBACK 11
+#define THREAD_ROLE_MAX 12
+
+// This callback is invoked on each thread the library creates before the thread
+// does anything else, so its affinity, scheduling policy and priority can be set
+// for its role. The library names the thread after its role where the platform
+// supports it, so the name can be changed here too.
+typedef void(*ConnListenerThreadStarted)(int role);
+
 typedef struct _CONNECTION_LISTENER_CALLBACKS {
     ConnListenerStageStarting stageStarting;
     ConnListenerStageComplete stageComplete;
@@ -244,6 +314,7 @@ typedef struct _CONNECTION_LISTENER_CALLBACKS {
     ConnListenerDisplayMessage displayMessage;
     ConnListenerDisplayTransientMessage displayTransientMessage;
     ConnListenerLogMessage logMessage;
+    ConnListenerThreadStarted threadStarted;
 } CONNECTION_LISTENER_CALLBACKS, *PCONNECTION_LISTENER_CALLBACKS;
 
 // Use this function to zero the connection callbacks when allocated on the stack or heap
@@ -286,6 +357,9 @@ void LiInterruptConnection(void);
 // from the integer passed to the ConnListenerStageXXX callbacks
 const char* LiGetStageName(int stage);
 
+// Use to get the name given to threads of a role passed to ConnListenerThreadStarted
+const char* LiGetThreadRoleName(int role);
+
 // This function queues a mouse move event to be sent to the remote server.
 int LiSendMouseMoveEvent(short deltaX, short deltaY);
 
@@ -339,6 +413,48 @@ int LiSendMultiControllerEvent(short controllerNumber, short activeGamepadMask,
 // This function queues a vertical scroll event to the remote server.
 int LiSendScrollEvent(signed char scrollClicks);
 
+// Frame completion times are counted in power of two buckets. Bucket 0 counts frames
+// completed within 1 ms of their first packet, bucket N those that took [2^(N-1), 2^N) ms,
+// and the last bucket everything slower.
+#define FEC_LATENCY_BUCKETS 12
+
+typedef struct _FEC_STATS {
+    // Video frames that arrived with all of their data packets
+    unsigned long long framesReceivedClean;
+
+    // Video frames that needed FEC to complete and the parity packets used to do it
+    unsigned long long framesRecovered;
+    unsigned long long parityPacketsUsed;
+
+    // Video frames that were lost despite FEC
+    unsigned long long framesUnrecoverable;
+
+    // Video packets that were dropped as duplicates or as too late to be useful
+    unsigned long long duplicatePackets;
+    unsigned long long latePackets;
+
+    // Time from the first packet of a frame to its completion
+    unsigned int cleanLatencyHistogram[FEC_LATENCY_BUCKETS];
+    unsigned int recoveredLatencyHistogram[FEC_LATENCY_BUCKETS];
+} FEC_STATS, *PFEC_STATS;
+
+// This function copies the video FEC statistics of the current connection. The
+// statistics are updated from the video receive thread without locking, so
+// counters may be momentarily inconsistent with each other.
+void LiGetFecStats(PFEC_STATS stats);
+
+typedef struct _BUSY_POLL_STATS {
+    // Video receives that found packets while spinning on the socket
+    unsigned long long spinHits;
+
+    // Video receives that spun for the whole window and had to sleep
+    unsigned long long spinMisses;
+} BUSY_POLL_STATS, *PBUSY_POLL_STATS;
+
+// This function copies the video busy poll statistics of the current connection.
+// Both counters stay at 0 unless StreamConfig.videoBusyPollUs is in effect.
+void LiGetBusyPollStats(PBUSY_POLL_STATS stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,5 +1,11 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// Needed for pthread_setname_np()
+#define _GNU_SOURCE
+#endif
+
 #include "PlatformThreads.h"
 #include "Platform.h"
+#include "Limelight-internal.h"
 
 #include <enet/enet.h>
 
@@ -9,6 +15,7 @@ void cleanupPlatformSockets(void);
 struct thread_context {
     ThreadEntry entry;
     void* context;
+    int role;
 #if defined(__vita__)
     PLT_THREAD* thread;
 #endif
@@ -40,6 +47,15 @@ void* ThreadProc(void* context) {
     struct thread_context* ctx = (struct thread_context*)context;
 #endif
 
+#if defined(__APPLE__)
+    pthread_setname_np(LiGetThreadRoleName(ctx->role));
+#elif defined(__linux__) && !defined(LC_CHROME)
+    pthread_setname_np(pthread_self(), LiGetThreadRoleName(ctx->role));
+#endif
+
+    // Let the app set up threads for their role before they do anything
+    ListenerCallbacks.threadStarted(ctx->role);
+
     ctx->entry(ctx->context);
 
 #if defined(__vita__)
@@ -150,7 +166,7 @@ void PltInterruptThread(PLT_THREAD* thread) {
     thread->cancelled = 1;
 }
 
-int PltCreateThread(ThreadEntry entry, void* context, PLT_THREAD* thread) {
+int PltCreateThread(int role, ThreadEntry entry, void* context, PLT_THREAD* thread) {
     struct thread_context* ctx;
 
     ctx = (struct thread_context*)malloc(sizeof(*ctx));
@@ -160,6 +176,7 @@ int PltCreateThread(ThreadEntry entry, void* context, PLT_THREAD* thread) {
 
     ctx->entry = entry;
     ctx->context = context;
+    ctx->role = role;
     
     thread->cancelled = 0;
 
@@ -176,7 +193,7 @@ int PltCreateThread(ThreadEntry entry, void* context, PLT_THREAD* thread) {
         thread->alive = 1;
         thread->context = ctx;
         ctx->thread = thread;
-        thread->handle = sceKernelCreateThread("", ThreadProc, 0, 0x40000, 0, 0, NULL);
+        thread->handle = sceKernelCreateThread(LiGetThreadRoleName(role), ThreadProc, 0, 0x40000, 0, 0, NULL);
         if (thread->handle < 0) {
             free(ctx);
             return -1;
@@ -245,16 +262,24 @@ void PltSetEvent(PLT_EVENT* event) {
     event->signalled = 1;
     sceKernelSignalCondAll(event->cond);
 #else
+    // Set under the mutex so a waiter can't miss the wakeup between
+    // checking signalled and blocking on the condition variable
+    pthread_mutex_lock(&event->mutex);
     event->signalled = 1;
     pthread_cond_broadcast(&event->cond);
+    pthread_mutex_unlock(&event->mutex);
 #endif
 }
 
 void PltClearEvent(PLT_EVENT* event) {
 #if defined(LC_WINDOWS)
     ResetEvent(*event);
+#elif defined(__vita__)
+    event->signalled = 0;
 #else
+    pthread_mutex_lock(&event->mutex);
     event->signalled = 0;
+    pthread_mutex_unlock(&event->mutex);
 #endif
 }
 
@@ -307,6 +332,32 @@ uint64_t PltGetMillis(void) {
 #endif
 }
 
+// Higher resolution than PltGetMillis(). This is the same clock
+// except on Windows, where it's QueryPerformanceCounter().
+uint64_t PltGetNanos(void) {
+#if defined(LC_WINDOWS)
+    LARGE_INTEGER counter, frequency;
+    
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    
+    return (counter.QuadPart / frequency.QuadPart) * 1000000000 +
+        (counter.QuadPart % frequency.QuadPart) * 1000000000 / frequency.QuadPart;
+#elif HAVE_CLOCK_GETTIME
+    struct timespec tv;
+    
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    
+    return (tv.tv_sec * 1000000000ULL) + tv.tv_nsec;
+#else
+    struct timeval tv;
+    
+    gettimeofday(&tv, NULL);
+    
+    return (tv.tv_sec * 1000000000ULL) + (tv.tv_usec * 1000ULL);
+#endif
+}
+
 int initializePlatform(void) {
     int err;
 
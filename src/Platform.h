@@ -64,3 +64,4 @@ int initializePlatform(void);
 void cleanupPlatform(void);
 
 uint64_t PltGetMillis(void);
+uint64_t PltGetNanos(void);
@@ -1,6 +1,72 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// Needed for recvmmsg()
+#define _GNU_SOURCE
+#endif
+
 #include "PlatformSockets.h"
 #include "Limelight-internal.h"
 
+#if defined(__linux__) && !defined(LC_CHROME)
+#define HAVE_RECVMMSG
+#define HAVE_UDP_GRO
+#define HAVE_SO_TIMESTAMPNS
+#define HAVE_BUSY_POLL
+#include <netinet/udp.h>
+
+// Older C libraries lack the Linux 5.0 definitions
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+// Set once the kernel turns out to lack recvmmsg(). It's shared by every
+// receiving thread and reset at the start of each connection.
+static volatile int recvmmsgUnsupported;
+#endif
+
+// Define HAVE_LIBURING and link with liburing 2.4 or later
+// to receive through io_uring on Linux (see README.md)
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+
+// The version macros first shipped with 2.4, which is also
+// where the buffer ring helpers we use settled
+#ifndef IO_URING_VERSION_MAJOR
+#error HAVE_LIBURING requires liburing 2.4 or later
+#endif
+
+// Each receive ring has its own io_uring, so one buffer group will do
+#define UDP_RING_BGID 0
+
+struct _UDP_RING {
+    struct io_uring uring;
+    struct io_uring_buf_ring* bufRing;
+    SOCKET s;
+    int size;
+    int count;
+
+    // The multishot receive stops when the kernel runs out of buffers
+    int armed;
+
+    UdpRingAllocBuffer allocBuffer;
+    UdpRingFreeBuffer freeBuffer;
+    void* context;
+
+    // Buffers posted to the kernel by buffer ID, NULL once handed out
+    char** buffers;
+    unsigned short* handedOutIds;
+    int handedOutCount;
+};
+#endif
+
 #define RCV_BUFFER_SIZE_MIN  32767
 #define RCV_BUFFER_SIZE_STEP 16384
 
@@ -44,9 +110,9 @@ void setRecvTimeout(SOCKET s, int timeoutSec) {
     }
 }
 
-int recvUdpSocket(SOCKET s, char* buffer, int size) {
+// Returns 1 once the socket is readable, 0 on timeout, or an error
+static int waitUdpSocket(SOCKET s) {
     fd_set readfds;
-    int err;
     struct timeval tv;
     
     FD_ZERO(&readfds);
@@ -56,7 +122,13 @@ int recvUdpSocket(SOCKET s, char* buffer, int size) {
     tv.tv_sec = 0;
     tv.tv_usec = 100 * 1000;
     
-    err = select((int)(s) + 1, &readfds, NULL, NULL, &tv);
+    return select((int)(s) + 1, &readfds, NULL, NULL, &tv);
+}
+
+int recvUdpSocket(SOCKET s, char* buffer, int size) {
+    int err;
+    
+    err = waitUdpSocket(s);
     if (err <= 0) {
         // Return if an error or timeout occurs
         return err;
@@ -66,6 +138,485 @@ int recvUdpSocket(SOCKET s, char* buffer, int size) {
     return (int)recv(s, buffer, size, 0);
 }
 
+#ifdef HAVE_SO_TIMESTAMPNS
+// Returns when a datagram arrived by the PltGetNanos() clock, going by its
+// kernel timestamp if it has one. The kernel stamps datagrams with the
+// realtime clock, so this works out how long ago that was.
+static uint64_t getArrivalTime(struct msghdr* msg, uint64_t now, struct timespec* realNow) {
+    struct cmsghdr* cmsg;
+    struct timespec stamp;
+    int64_t ageNs;
+    
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+            ageNs = (int64_t)(realNow->tv_sec - stamp.tv_sec) * 1000000000 +
+                    (realNow->tv_nsec - stamp.tv_nsec);
+            
+            // A step of the realtime clock can put stamps in the future
+            if (ageNs >= 0 && (uint64_t)ageNs < now) {
+                return now - ageNs;
+            }
+            break;
+        }
+    }
+    
+    return now;
+}
+#endif
+
+// Has the kernel spin on the device queue for up to busyPollUs when the socket
+// is read with nothing queued. Returns non-zero where readUdpSocketBatch() and
+// readUdpSocketGro() can't be called on a socket that isn't readable yet.
+int enableBusyPoll(SOCKET s, int busyPollUs) {
+#ifdef HAVE_BUSY_POLL
+    int val;
+    
+    // Raising the busy poll time above net.core.busy_read needs CAP_NET_ADMIN,
+    // but spinning on the socket from user space still helps without it
+    val = busyPollUs;
+    if (setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, (char*)&val, sizeof(val)) < 0) {
+        Limelog("setsockopt(SO_BUSY_POLL) failed: %d\n", (int)LastSocketError());
+    }
+    
+    // Linux 5.11 and later can keep interrupts deferred while we poll
+    val = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_PREFER_BUSY_POLL, (char*)&val, sizeof(val)) < 0) {
+        Limelog("setsockopt(SO_PREFER_BUSY_POLL) failed: %d\n", (int)LastSocketError());
+    }
+    
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+// Stamps datagrams as they arrive. Returns non-zero where that isn't supported.
+int enableUdpTimestamps(SOCKET s) {
+#ifdef HAVE_SO_TIMESTAMPNS
+    int val = 1;
+    
+    return setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, (char*)&val, sizeof(val));
+#else
+    return -1;
+#endif
+}
+
+// Like recvUdpSocketBatch() but for a socket already known to be readable,
+// so it doesn't wait. Returns 0 if nothing turned out to be queued.
+int readUdpSocketBatch(SOCKET s, char** buffers, int* lengths, uint64_t* receiveTimesNs, int size, int count) {
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msgs[UDP_BATCH_MAX];
+    struct iovec iovs[UDP_BATCH_MAX];
+    union {
+        char buf[CMSG_SPACE(sizeof(struct timespec))];
+        struct cmsghdr align;
+    } controls[UDP_BATCH_MAX];
+    struct timespec realNow;
+    uint64_t now;
+    int i;
+#endif
+    int flags;
+    int err;
+    
+    LC_ASSERT(count > 0);
+    
+#ifdef HAVE_RECVMMSG
+    if (!recvmmsgUnsupported) {
+        if (count > UDP_BATCH_MAX) {
+            count = UDP_BATCH_MAX;
+        }
+        
+        memset(msgs, 0, sizeof(msgs[0]) * count);
+        for (i = 0; i < count; i++) {
+            iovs[i].iov_base = buffers[i];
+            iovs[i].iov_len = size;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            if (receiveTimesNs != NULL) {
+                msgs[i].msg_hdr.msg_control = controls[i].buf;
+                msgs[i].msg_hdr.msg_controllen = sizeof(controls[i].buf);
+            }
+        }
+        
+        // Take whatever is queued without waiting for a full batch
+        err = recvmmsg(s, msgs, count, MSG_DONTWAIT, NULL);
+        if (err > 0) {
+            if (receiveTimesNs != NULL) {
+                now = PltGetNanos();
+                clock_gettime(CLOCK_REALTIME, &realNow);
+            }
+            for (i = 0; i < err; i++) {
+                lengths[i] = (int)msgs[i].msg_len;
+                if (receiveTimesNs != NULL) {
+                    receiveTimesNs[i] = getArrivalTime(&msgs[i].msg_hdr, now, &realNow);
+                }
+            }
+            return err;
+        }
+        else if (err < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        else if (err < 0 && errno == ENOSYS) {
+            // Old kernels lack recvmmsg(), so fall back to recv()
+            recvmmsgUnsupported = 1;
+        }
+        else {
+            return err;
+        }
+    }
+#endif
+    
+#ifdef HAVE_BUSY_POLL
+    // Busy polling reads the socket before it's readable
+    flags = MSG_DONTWAIT;
+#else
+    // This won't block since the socket is readable
+    flags = 0;
+#endif
+    err = (int)recv(s, buffers[0], size, flags);
+    if (err < 0 && flags != 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    else if (err <= 0) {
+        return err;
+    }
+    
+    lengths[0] = err;
+    if (receiveTimesNs != NULL) {
+        receiveTimesNs[0] = PltGetNanos();
+    }
+    return 1;
+}
+
+// Receives up to count datagrams of up to size bytes each into buffers, storing
+// their lengths in lengths and, unless it's NULL, their arrival times by the
+// PltGetNanos() clock in receiveTimesNs. Returns the number received, 0 on
+// timeout, or an error. Platforms without recvmmsg() receive one datagram per call.
+int recvUdpSocketBatch(SOCKET s, char** buffers, int* lengths, uint64_t* receiveTimesNs, int size, int count) {
+    int err;
+    
+    err = waitUdpSocket(s);
+    if (err <= 0) {
+        // Return if an error or timeout occurs
+        return err;
+    }
+    
+    return readUdpSocketBatch(s, buffers, lengths, receiveTimesNs, size, count);
+}
+
+// Has the kernel coalesce runs of same-sized datagrams into one receive.
+// Returns non-zero where that isn't supported.
+int enableUdpGro(SOCKET s) {
+#ifdef HAVE_UDP_GRO
+    int val = 1;
+    
+    // Linux kernels before 5.0 reject this
+    return setsockopt(s, SOL_UDP, UDP_GRO, (char*)&val, sizeof(val));
+#else
+    return -1;
+#endif
+}
+
+// Like readUdpSocketBatch() for a socket with UDP GRO enabled. Receives one
+// run of datagrams, each segmentSize long except maybe the last.
+int readUdpSocketGro(SOCKET s, char* buffer, int size, int* segmentSize, uint64_t* receiveTimeNs) {
+#ifdef HAVE_UDP_GRO
+    union {
+        char buf[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct timespec))];
+        struct cmsghdr align;
+    } control;
+    struct timespec realNow;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    int err;
+    
+    iov.iov_base = buffer;
+    iov.iov_len = size;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    
+    err = (int)recvmsg(s, &msg, MSG_DONTWAIT);
+    if (err < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    else if (err <= 0) {
+        return err;
+    }
+    
+    // Datagrams the kernel didn't coalesce come without a segment size
+    *segmentSize = err;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            memcpy(segmentSize, CMSG_DATA(cmsg), sizeof(*segmentSize));
+            break;
+        }
+    }
+    if (*segmentSize <= 0) {
+        *segmentSize = err;
+    }
+    
+    // The whole run gets the arrival time of its first datagram
+    clock_gettime(CLOCK_REALTIME, &realNow);
+    *receiveTimeNs = getArrivalTime(&msg, PltGetNanos(), &realNow);
+    
+    return err;
+#else
+    LC_ASSERT(0);
+    return -1;
+#endif
+}
+
+// Like recvUdpSocketBatch() for a socket with UDP GRO enabled
+int recvUdpSocketGro(SOCKET s, char* buffer, int size, int* segmentSize, uint64_t* receiveTimeNs) {
+    int err;
+    
+    err = waitUdpSocket(s);
+    if (err <= 0) {
+        // Return if an error or timeout occurs
+        return err;
+    }
+    
+    return readUdpSocketGro(s, buffer, size, segmentSize, receiveTimeNs);
+}
+
+#ifdef HAVE_LIBURING
+static void postRingBuffer(PUDP_RING ring, char* buffer, unsigned short bid) {
+    ring->buffers[bid] = buffer;
+    io_uring_buf_ring_add(ring->bufRing, buffer, ring->size, bid, io_uring_buf_ring_mask(ring->count), 0);
+    io_uring_buf_ring_advance(ring->bufRing, 1);
+}
+
+static int armRing(PUDP_RING ring) {
+    struct io_uring_sqe* sqe;
+    int err;
+
+    sqe = io_uring_get_sqe(&ring->uring);
+    LC_ASSERT(sqe != NULL);
+
+    // One receive keeps completing into whichever posted buffer is next
+    io_uring_prep_recv_multishot(sqe, ring->s, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = UDP_RING_BGID;
+
+    err = io_uring_submit(&ring->uring);
+    if (err < 0) {
+        return err;
+    }
+
+    ring->armed = 1;
+    return 0;
+}
+#endif
+
+// Creates a ring of count buffers of up to size bytes, from allocBuffer(),
+// that the kernel receives datagrams from s into. count must be a power of 2.
+// Returns NULL where that isn't supported, so callers use recvUdpSocketBatch().
+PUDP_RING createUdpRing(SOCKET s, int size, int count, UdpRingAllocBuffer allocBuffer,
+                        UdpRingFreeBuffer freeBuffer, void* context) {
+#ifdef HAVE_LIBURING
+    PUDP_RING ring;
+    char* buffer;
+    int err;
+    int i;
+
+    LC_ASSERT(count > 0 && (count & (count - 1)) == 0);
+
+    ring = (PUDP_RING)calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    ring->s = s;
+    ring->size = size;
+    ring->count = count;
+    ring->allocBuffer = allocBuffer;
+    ring->freeBuffer = freeBuffer;
+    ring->context = context;
+
+    ring->buffers = (char**)calloc(count, sizeof(*ring->buffers));
+    ring->handedOutIds = (unsigned short*)malloc(count * sizeof(*ring->handedOutIds));
+    if (ring->buffers == NULL || ring->handedOutIds == NULL) {
+        goto FreeRing;
+    }
+
+    // Kernels without io_uring or provided buffer rings fail here
+    err = io_uring_queue_init(4, &ring->uring, 0);
+    if (err < 0) {
+        Limelog("io_uring_queue_init() failed: %d\n", -err);
+        goto FreeRing;
+    }
+
+    ring->bufRing = io_uring_setup_buf_ring(&ring->uring, count, UDP_RING_BGID, 0, &err);
+    if (ring->bufRing == NULL) {
+        Limelog("io_uring_setup_buf_ring() failed: %d\n", -err);
+        goto ExitUring;
+    }
+
+    for (i = 0; i < count; i++) {
+        buffer = (char*)allocBuffer(context);
+        if (buffer == NULL) {
+            goto FreeBuffers;
+        }
+
+        postRingBuffer(ring, buffer, (unsigned short)i);
+    }
+
+    // Multishot receive needs Linux 6.0
+    err = armRing(ring);
+    if (err < 0) {
+        Limelog("io_uring_submit() failed: %d\n", -err);
+        goto FreeBuffers;
+    }
+
+    return ring;
+
+FreeBuffers:
+    io_uring_free_buf_ring(&ring->uring, ring->bufRing, count, UDP_RING_BGID);
+    for (i = 0; i < count; i++) {
+        if (ring->buffers[i] != NULL) {
+            freeBuffer(context, ring->buffers[i]);
+        }
+    }
+ExitUring:
+    io_uring_queue_exit(&ring->uring);
+FreeRing:
+    free(ring->buffers);
+    free(ring->handedOutIds);
+    free(ring);
+#endif
+    return NULL;
+}
+
+// Receives up to count datagrams like recvUdpSocketBatch(), except that the
+// buffers come from the ring and belong to the caller afterwards. Buffers the
+// caller passes back in non-NULL slots of buffers are reused by the ring.
+int recvUdpRing(PUDP_RING ring, char** buffers, int* lengths, uint64_t* receiveTimesNs, int count) {
+#ifdef HAVE_LIBURING
+    struct io_uring_cqe* cqe;
+    struct __kernel_timespec ts;
+    uint64_t now;
+    unsigned short bid;
+    char* buffer;
+    int received;
+    int err;
+    int i;
+
+    // Give the kernel back every buffer handed out, preferring the caller's
+    for (i = 0; i < count; i++) {
+        if (buffers[i] != NULL) {
+            if (ring->handedOutCount > 0) {
+                postRingBuffer(ring, buffers[i], ring->handedOutIds[--ring->handedOutCount]);
+            }
+            else {
+                ring->freeBuffer(ring->context, buffers[i]);
+            }
+            buffers[i] = NULL;
+        }
+    }
+    while (ring->handedOutCount > 0) {
+        buffer = (char*)ring->allocBuffer(ring->context);
+        if (buffer == NULL) {
+            // Try again next time
+            break;
+        }
+
+        postRingBuffer(ring, buffer, ring->handedOutIds[--ring->handedOutCount]);
+    }
+
+    if (!ring->armed) {
+        err = armRing(ring);
+        if (err < 0) {
+            SetLastSocketError(-err);
+            return -1;
+        }
+    }
+
+    // Wait up to 100 ms for a datagram like recvUdpSocket()
+    ts.tv_sec = 0;
+    ts.tv_nsec = 100 * 1000 * 1000;
+    err = io_uring_wait_cqe_timeout(&ring->uring, &cqe, &ts);
+    if (err == -ETIME || err == -EINTR) {
+        return 0;
+    }
+    else if (err < 0) {
+        SetLastSocketError(-err);
+        return -1;
+    }
+
+    // Multishot receive can't return kernel timestamps
+    now = PltGetNanos();
+
+    received = 0;
+    while (received < count && io_uring_peek_cqe(&ring->uring, &cqe) == 0) {
+        if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+            // Rearmed on the next call, once there are buffers again
+            ring->armed = 0;
+        }
+
+        if (cqe->res < 0) {
+            err = cqe->res;
+            io_uring_cqe_seen(&ring->uring, cqe);
+
+            if (err == -ENOBUFS) {
+                continue;
+            }
+            else if (received > 0) {
+                // Report the error once the caller has these buffers
+                break;
+            }
+
+            SetLastSocketError(-err);
+            return -1;
+        }
+
+        LC_ASSERT(cqe->flags & IORING_CQE_F_BUFFER);
+        bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+        buffers[received] = ring->buffers[bid];
+        lengths[received] = cqe->res;
+        if (receiveTimesNs != NULL) {
+            receiveTimesNs[received] = now;
+        }
+        received++;
+
+        ring->buffers[bid] = NULL;
+        ring->handedOutIds[ring->handedOutCount++] = bid;
+
+        io_uring_cqe_seen(&ring->uring, cqe);
+    }
+
+    return received;
+#else
+    LC_ASSERT(0);
+    return -1;
+#endif
+}
+
+void destroyUdpRing(PUDP_RING ring) {
+#ifdef HAVE_LIBURING
+    int i;
+
+    // Once the buffer group is gone, the receive can't fill any more buffers
+    io_uring_free_buf_ring(&ring->uring, ring->bufRing, ring->count, UDP_RING_BGID);
+    io_uring_queue_exit(&ring->uring);
+
+    for (i = 0; i < ring->count; i++) {
+        if (ring->buffers[i] != NULL) {
+            ring->freeBuffer(ring->context, ring->buffers[i]);
+        }
+    }
+
+    free(ring->buffers);
+    free(ring->handedOutIds);
+    free(ring);
+#endif
+}
+
 void closeSocket(SOCKET s) {
 #if defined(LC_WINDOWS)
     closesocket(s);
@@ -254,6 +805,10 @@ int enableNoDelay(SOCKET s) {
 }
 
 int initializePlatformSockets(void) {
+#ifdef HAVE_RECVMMSG
+    recvmmsgUnsupported = 0;
+#endif
+
 #if defined(LC_WINDOWS)
     WSADATA data;
     return WSAStartup(MAKEWORD(2, 0), &data);
@@ -68,6 +68,28 @@ SOCKET connectTcpSocket(struct sockaddr_storage* dstaddr, SOCKADDR_LEN addrlen,
 SOCKET bindUdpSocket(int addrfamily, int bufferSize);
 int enableNoDelay(SOCKET s);
 int recvUdpSocket(SOCKET s, char* buffer, int size);
+
+// Most datagrams recvUdpSocketBatch() receives in one call
+#define UDP_BATCH_MAX 64
+int recvUdpSocketBatch(SOCKET s, char** buffers, int* lengths, uint64_t* receiveTimesNs, int size, int count);
+int readUdpSocketBatch(SOCKET s, char** buffers, int* lengths, uint64_t* receiveTimesNs, int size, int count);
+int enableUdpTimestamps(SOCKET s);
+int enableBusyPoll(SOCKET s, int busyPollUs);
+
+// Largest run of datagrams UDP GRO coalesces into one receive
+#define UDP_GRO_MAX 65536
+int enableUdpGro(SOCKET s);
+int recvUdpSocketGro(SOCKET s, char* buffer, int size, int* segmentSize, uint64_t* receiveTimeNs);
+int readUdpSocketGro(SOCKET s, char* buffer, int size, int* segmentSize, uint64_t* receiveTimeNs);
+
+// Receive ring the kernel fills from a caller's buffers, where io_uring is available
+typedef struct _UDP_RING *PUDP_RING;
+typedef void*(*UdpRingAllocBuffer)(void* context);
+typedef void(*UdpRingFreeBuffer)(void* context, void* buffer);
+PUDP_RING createUdpRing(SOCKET s, int size, int count, UdpRingAllocBuffer allocBuffer,
+                        UdpRingFreeBuffer freeBuffer, void* context);
+int recvUdpRing(PUDP_RING ring, char** buffers, int* lengths, uint64_t* receiveTimesNs, int count);
+void destroyUdpRing(PUDP_RING ring);
 void shutdownTcpSocket(SOCKET s);
 void setRecvTimeout(SOCKET s, int timeoutSec);
 void closeSocket(SOCKET s);
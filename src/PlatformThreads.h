@@ -45,7 +45,7 @@ void PltDeleteMutex(PLT_MUTEX* mutex);
 void PltLockMutex(PLT_MUTEX* mutex);
 void PltUnlockMutex(PLT_MUTEX* mutex);
 
-int PltCreateThread(ThreadEntry entry, void* context, PLT_THREAD*thread);
+int PltCreateThread(int role, ThreadEntry entry, void* context, PLT_THREAD*thread);
 void PltCloseThread(PLT_THREAD*thread);
 void PltInterruptThread(PLT_THREAD*thread);
 int PltIsThreadInterrupted(PLT_THREAD*thread);
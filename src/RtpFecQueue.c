@@ -1,344 +1,1079 @@
 #include "Limelight-internal.h"
 #include "RtpFecQueue.h"
-#include "rs.h"
 
 #define ushort(x) ((unsigned short) ((x) % (UINT16_MAX+1)))
 #define isBefore(x, y) (ushort((x) - (y)) > (UINT16_MAX/2))
 
-void RtpfInitializeQueue(PRTP_FEC_QUEUE queue) {
+// FEC is applied from here on, leaving the RTP header byte, packet type, and
+// sequence number of folded parity packets intact. Recovered packets get their
+// sequence number filled in.
+#define RTPF_FEC_OFFSET 4
+
+// Recoveries with less multiply work than this (in bytes) aren't worth
+// waking the workers for
+#define RTPF_PARALLEL_MIN_WORK (256 * 1024)
+
+static void FecWorkerThreadProc(void* context) {
+    PRTPF_WORKER worker = (PRTPF_WORKER)context;
+
+    for (;;) {
+        PltWaitForEvent(&worker->workEvent);
+        PltClearEvent(&worker->workEvent);
+
+        if (PltIsThreadInterrupted(&worker->thread)) {
+            break;
+        }
+
+        worker->ret = reed_solomon_solve_in_place(worker->job->lu, worker->job->blocks, worker->job->count,
+                                                  worker->offset, worker->end);
+        PltSetEvent(&worker->doneEvent);
+    }
+}
+
+static void startWorkers(PRTP_FEC_QUEUE queue, int count) {
+    if (count > RTPF_MAX_WORKERS) {
+        count = RTPF_MAX_WORKERS;
+    }
+
+    for (queue->workerCount = 0; queue->workerCount < count; queue->workerCount++) {
+        PRTPF_WORKER worker = &queue->workers[queue->workerCount];
+
+        worker->job = &queue->solveJob;
+
+        if (PltCreateEvent(&worker->workEvent) != 0) {
+            break;
+        }
+        if (PltCreateEvent(&worker->doneEvent) != 0) {
+            PltCloseEvent(&worker->workEvent);
+            break;
+        }
+        if (PltCreateThread(THREAD_ROLE_FEC_WORKER, FecWorkerThreadProc, worker, &worker->thread) != 0) {
+            PltCloseEvent(&worker->workEvent);
+            PltCloseEvent(&worker->doneEvent);
+            break;
+        }
+    }
+
+    // Recovery still works with fewer workers, just more of it is serial
+    if (queue->workerCount != count) {
+        Limelog("Started %d of %d FEC worker threads\n", queue->workerCount, count);
+    }
+}
+
+static void stopWorkers(PRTP_FEC_QUEUE queue) {
+    int i;
+
+    for (i = 0; i < queue->workerCount; i++) {
+        PRTPF_WORKER worker = &queue->workers[i];
+
+        PltInterruptThread(&worker->thread);
+        PltSetEvent(&worker->workEvent);
+        PltJoinThread(&worker->thread);
+        PltCloseThread(&worker->thread);
+        PltCloseEvent(&worker->workEvent);
+        PltCloseEvent(&worker->doneEvent);
+    }
+
+    queue->workerCount = 0;
+}
+
+void RtpfInitializeQueue(PRTP_FEC_QUEUE queue, PBUFFER_POOL pool) {
     reed_solomon_init();
     memset(queue, 0, sizeof(*queue));
+    queue->pool = pool;
     queue->nextRtpSequenceNumber = UINT16_MAX;
     
     queue->currentFrameNumber = UINT16_MAX;
+
+    PltCreateMutex(&queue->refMutex);
+
+    if (StreamConfig.fecWorkerThreads > 0) {
+        startWorkers(queue, StreamConfig.fecWorkerThreads);
+    }
+}
+
+// Drops our reference to each entry of a list
+static void freeEntries(PRTP_FEC_QUEUE queue, PRTPFEC_QUEUE_ENTRY head) {
+    while (head != NULL) {
+        PRTPFEC_QUEUE_ENTRY entry = head;
+        head = entry->next;
+        RtpfReleasePacket(queue, entry);
+    }
+}
+
+// Moves the list from head to tail onto the end of another list
+static void appendEntries(PRTPFEC_QUEUE_ENTRY* listHead, PRTPFEC_QUEUE_ENTRY* listTail,
+                          PRTPFEC_QUEUE_ENTRY head, PRTPFEC_QUEUE_ENTRY tail) {
+    if (head == NULL) {
+        return;
+    }
+
+    if (*listTail == NULL) {
+        *listHead = head;
+    } else {
+        (*listTail)->next = head;
+    }
+    *listTail = tail;
+}
+
+// Returns the video header following the RTP header of a packet
+static PNV_VIDEO_PACKET getVideoPacket(PRTP_PACKET packet) {
+    int dataOffset = sizeof(*packet);
+    if (packet->header & FLAG_EXTENSION) {
+        dataOffset += 4; // 2 additional fields
+    }
+
+    return (PNV_VIDEO_PACKET)(((char*)packet) + dataOffset);
+}
+
+// Frees every packet of the FEC block being assembled
+static void discardBuffer(PRTP_FEC_QUEUE queue, PRTPF_FRAME frame) {
+    int i, span;
+
+    if (frame->bufferSize == 0) {
+        return;
+    }
+
+    // Packets only ever land between the lowest and highest sequence numbers
+    span = ushort(frame->bufferHighestSequenceNumber - frame->bufferLowestSequenceNumber);
+    if (span >= RTPF_BUFFER_SLOTS) {
+        span = RTPF_BUFFER_SLOTS - 1;
+    }
+
+    for (i = 0; i <= span; i++) {
+        if (frame->bufferSlots[i] != NULL) {
+            RtpfReleasePacket(queue, frame->bufferSlots[i]);
+            frame->bufferSlots[i] = NULL;
+        }
+    }
+
+    frame->bufferSize = 0;
+}
+
+// Frees the completed FEC blocks and held packets of a frame
+static void discardHeldPackets(PRTP_FEC_QUEUE queue, PRTPF_FRAME frame) {
+    freeEntries(queue, frame->blockHead);
+    frame->blockHead = NULL;
+    frame->blockTail = NULL;
+    frame->blockSize = 0;
+
+    freeEntries(queue, frame->pendingHead);
+    frame->pendingHead = NULL;
+    frame->pendingTail = NULL;
+    frame->pendingSize = 0;
+}
+
+// Frees every packet a frame holds and returns its slot to the window
+static void releaseFrame(PRTP_FEC_QUEUE queue, PRTPF_FRAME frame) {
+    discardBuffer(queue, frame);
+    discardHeldPackets(queue, frame);
+
+    frame->state = RTPF_FRAME_FREE;
 }
 
 void RtpfCleanupQueue(PRTP_FEC_QUEUE queue) {
-    while (queue->bufferHead != NULL) {
-        PRTPFEC_QUEUE_ENTRY entry = queue->bufferHead;
-        queue->bufferHead = entry->next;
-        free(entry->packet);
+    int i;
+
+    for (i = 0; i < RTPF_FRAME_WINDOW; i++) {
+        releaseFrame(queue, &queue->frames[i]);
     }
-    
-    while (queue->queueHead != NULL) {
-        PRTPFEC_QUEUE_ENTRY entry = queue->queueHead;
-        queue->queueHead = entry->next;
-        free(entry->packet);
+
+    freeEntries(queue, queue->queueHead);
+    queue->queueHead = NULL;
+
+    for (i = 0; i < RTPF_CODEC_CACHE_SIZE; i++) {
+        reed_solomon_release(queue->codecCache[i]);
+        queue->codecCache[i] = NULL;
     }
+
+    stopWorkers(queue);
+
+    PltDeleteMutex(&queue->refMutex);
 }
 
-// newEntry is contained within the packet buffer so we free the whole entry by freeing entry->packet
-static int queuePacket(PRTP_FEC_QUEUE queue, PRTPFEC_QUEUE_ENTRY newEntry, int head, PRTP_PACKET packet, int length, int isParity) {
-    PRTPFEC_QUEUE_ENTRY entry;
+// Returns a codec for the given FEC parameters, building one only if
+// we haven't seen this combination recently. The codec is owned by the queue.
+static reed_solomon* getCodec(PRTP_FEC_QUEUE queue, int dataShards, int parityShards) {
+    reed_solomon* rs = NULL;
+    int i;
+
+    for (i = 0; i < RTPF_CODEC_CACHE_SIZE; i++) {
+        rs = queue->codecCache[i];
+        if (rs != NULL && rs->data_shards == dataShards && rs->parity_shards == parityShards) {
+            break;
+        }
+    }
+
+    if (i == RTPF_CODEC_CACHE_SIZE) {
+        rs = reed_solomon_new(dataShards, parityShards);
+        if (rs == NULL) {
+            return NULL;
+        }
+
+        // Evict the least recently used codec
+        i = RTPF_CODEC_CACHE_SIZE - 1;
+        reed_solomon_release(queue->codecCache[i]);
+    }
+
+    // Move this codec to the front
+    memmove(&queue->codecCache[1], &queue->codecCache[0], i * sizeof(queue->codecCache[0]));
+    queue->codecCache[0] = rs;
+
+    return rs;
+}
+
+// newEntry is contained within the packet buffer so we free the whole entry by returning entry->packet to the pool
+static int queuePacket(PRTP_FEC_QUEUE queue, PRTPF_FRAME frame, PRTPFEC_QUEUE_ENTRY newEntry, PRTP_PACKET packet, int length,
+                       unsigned long long receiveTimeNs, int isParity) {
+    int index;
     
     LC_ASSERT(!isBefore(packet->sequenceNumber, queue->nextRtpSequenceNumber));
 
-    // Don't queue duplicates either
-    entry = queue->bufferHead;
-    while (entry != NULL) {
-        if (entry->packet->sequenceNumber == packet->sequenceNumber) {
-            return 0;
-        }
+    // Packets are slotted by their offset into the FEC block
+    index = ushort(packet->sequenceNumber - frame->bufferLowestSequenceNumber);
+    if (index >= RTPF_BUFFER_SLOTS) {
+        return 0;
+    }
 
-        entry = entry->next;
+    // Don't queue duplicates either
+    if (frame->bufferSlots[index] != NULL) {
+        queue->stats.duplicatePackets++;
+        return 0;
     }
 
     newEntry->packet = packet;
     newEntry->length = length;
     newEntry->isParity = isParity;
-    newEntry->receiveTimeMs = PltGetMillis();
-    newEntry->prev = NULL;
+    newEntry->receiveTimeNs = receiveTimeNs;
+    newEntry->receiveTimeMs = receiveTimeNs / 1000000;
+    newEntry->refCount = 1;
     newEntry->next = NULL;
 
-    if (queue->bufferHead == NULL) {
-        LC_ASSERT(queue->bufferSize == 0);
-        queue->bufferHead = queue->bufferTail = newEntry;
+    frame->bufferSlots[index] = newEntry;
+    frame->bufferSize++;
+
+    // This packet was taken as lost, but it's late rather than gone
+    if (index < frame->bufferLossScanIndex) {
+        if (index < frame->bufferDataPackets) {
+            frame->bufferLostDataPackets--;
+        }
+        else {
+            frame->bufferLostParityPackets--;
+        }
     }
-    else if (head) {
-        LC_ASSERT(queue->bufferSize > 0);
-        PRTPFEC_QUEUE_ENTRY oldHead = queue->bufferHead;
-        newEntry->next = oldHead;
-        LC_ASSERT(oldHead->prev == NULL);
-        oldHead->prev = newEntry;
-        queue->bufferHead = newEntry;
+
+    return 1;
+}
+
+// Grows the byte range that folded parity packets are valid over. Everything
+// past a packet's length is treated as zero padding, so only the newly covered
+// part of each folded parity packet's padding needs to be zeroed.
+static void growFoldExtent(PRTPF_FRAME frame, int length) {
+    int receiveSize = StreamConfig.packetSize + MAX_RTP_HEADER_SIZE;
+    int i;
+
+    if (length > receiveSize) {
+        length = receiveSize;
     }
-    else {
-        LC_ASSERT(queue->bufferSize > 0);
-        PRTPFEC_QUEUE_ENTRY oldTail = queue->bufferTail;
-        newEntry->prev = oldTail;
-        LC_ASSERT(oldTail->next == NULL);
-        oldTail->next = newEntry;
-        queue->bufferTail = newEntry;
+
+    if (length <= frame->bufferFoldExtent) {
+        return;
     }
-    queue->bufferSize++;
 
-    return 1;
+    for (i = 0; i < frame->bufferParityPackets; i++) {
+        memset(((char*)frame->bufferParity[i]->packet) + frame->bufferFoldExtent, 0,
+               length - frame->bufferFoldExtent);
+    }
+
+    frame->bufferFoldExtent = length;
+}
+
+// Folds a newly queued packet into the parity packets we'll recover with. Data packets
+// go into every parity packet folded so far and parity packets take all data received
+// so far, so each parity packet ends up depending only on the missing data packets.
+// This spreads the FEC work across the frame instead of doing it all after the last packet.
+// Only the bytes up to each data packet's length are folded since the rest is padding.
+static void foldPacket(PRTP_FEC_QUEUE queue, PRTPF_FRAME frame, PRTPFEC_QUEUE_ENTRY newEntry) {
+    PRTPFEC_QUEUE_ENTRY entry;
+    int i;
+
+    if (!newEntry->isParity) {
+        int dataIndex = ushort(newEntry->packet->sequenceNumber - frame->bufferLowestSequenceNumber);
+
+        growFoldExtent(frame, newEntry->length);
+
+        for (i = 0; i < frame->bufferParityPackets; i++) {
+            entry = frame->bufferParity[i];
+            reed_solomon_fold(frame->bufferCodec, (unsigned char*)entry->packet,
+                              ushort(entry->packet->sequenceNumber - frame->bufferFirstParitySequenceNumber),
+                              (unsigned char*)newEntry->packet, dataIndex,
+                              RTPF_FEC_OFFSET, newEntry->length);
+        }
+        return;
+    }
+
+    // Don't spend time on parity packets we won't need
+    if (frame->bufferParityPackets >= frame->bufferDataPackets - frame->receivedBufferDataPackets) {
+        return;
+    }
+
+    int totalParityPackets = (frame->bufferDataPackets * frame->fecPercentage + 99) / 100;
+    int parityIndex = ushort(newEntry->packet->sequenceNumber - frame->bufferFirstParitySequenceNumber);
+    if (parityIndex >= totalParityPackets) {
+        return;
+    }
+
+    if (frame->bufferCodec == NULL) {
+        frame->bufferCodec = getCodec(queue, frame->bufferDataPackets, totalParityPackets);
+
+        // This could happen in an OOM condition, but it could also mean the FEC data
+        // that we fed to reed_solomon_new() is bogus, so we'll assert to get a better look.
+        LC_ASSERT(frame->bufferCodec != NULL);
+        if (frame->bufferCodec == NULL) {
+            return;
+        }
+    }
+
+    growFoldExtent(frame, newEntry->length);
+    if (newEntry->length < frame->bufferFoldExtent) {
+        memset(((char*)newEntry->packet) + newEntry->length, 0, frame->bufferFoldExtent - newEntry->length);
+    }
+
+    // A codec exists, so the data packets fit in DATA_SHARDS_MAX slots
+    for (i = 0; i < frame->bufferDataPackets; i++) {
+        entry = frame->bufferSlots[i];
+        if (entry != NULL) {
+            reed_solomon_fold(frame->bufferCodec, (unsigned char*)newEntry->packet, parityIndex,
+                              (unsigned char*)entry->packet, i,
+                              RTPF_FEC_OFFSET, entry->length);
+        }
+    }
+
+    frame->bufferParity[frame->bufferParityPackets++] = newEntry;
+}
+
+// Recovers the missing packets, splitting the byte range across the
+// workers when there's enough work to be worth it
+static int solveFrame(PRTP_FEC_QUEUE queue, int count, int offset, int end) {
+    int ret, i, used, chunk;
+
+    if (queue->workerCount == 0 || count * count * (end - offset) < RTPF_PARALLEL_MIN_WORK) {
+        return reed_solomon_solve_in_place(queue->workspace.lu, queue->workspace.blocks, count, offset, end);
+    }
+
+    queue->solveJob.lu = queue->workspace.lu;
+    queue->solveJob.blocks = queue->workspace.blocks;
+    queue->solveJob.count = count;
+
+    // Split on cache line boundaries of the packet buffers, which the pool
+    // aligns, so neighbouring ranges never write to the same line. The first
+    // range takes the unaligned head after RTPF_FEC_OFFSET.
+    chunk = (((end - offset) / (queue->workerCount + 1)) + 63) & ~63;
+
+    for (used = 0; used < queue->workerCount && end - offset > chunk; used++) {
+        PRTPF_WORKER worker = &queue->workers[used];
+
+        worker->offset = offset;
+        worker->end = (offset + chunk) & ~63;
+        offset = worker->end;
+
+        PltClearEvent(&worker->doneEvent);
+        PltSetEvent(&worker->workEvent);
+    }
+
+    // This thread takes the last range
+    ret = reed_solomon_solve_in_place(queue->workspace.lu, queue->workspace.blocks, count, offset, end);
+
+    for (i = 0; i < used; i++) {
+        PltWaitForEvent(&queue->workers[i].doneEvent);
+        if (queue->workers[i].ret != 0) {
+            ret = queue->workers[i].ret;
+        }
+    }
+
+    return ret;
 }
 
 // Returns 0 if the frame is completely constructed
-static int reconstructFrame(PRTP_FEC_QUEUE queue) {
-    int totalPackets = ushort(queue->bufferHighestSequenceNumber - queue->bufferLowestSequenceNumber) + 1;
-    int totalParityPackets = (queue->bufferDataPackets * queue->fecPercentage + 99) / 100;
-    int parityPackets = totalPackets - queue->bufferDataPackets;
-    int missingPackets = totalPackets - queue->bufferSize;
+static int reconstructFrame(PRTP_FEC_QUEUE queue, PRTPF_FRAME frame) {
+    PRTPF_WORKSPACE workspace = &queue->workspace;
+    PRTPFEC_QUEUE_ENTRY entry;
+    int missingPackets = frame->bufferDataPackets - frame->receivedBufferDataPackets;
     int ret;
-    
-    if (parityPackets < missingPackets) {
+    int i, j;
+
+    if (missingPackets == 0) {
+        // We've received a full frame with no need for FEC.
+        return 0;
+    }
+
+    if (frame->bufferParityPackets < missingPackets) {
         // Not enough parity data to recover yet
         return -1;
     }
-    
-    if (queue->receivedBufferDataPackets == queue->bufferDataPackets) {
-        // We've received a full frame with no need for FEC.
-        return 0;
+
+    // Parity packets are only folded for a codec that exists, so the data count fits
+    j = 0;
+    for (i = 0; i < frame->bufferDataPackets && j < missingPackets; i++) {
+        if (frame->bufferSlots[i] == NULL) {
+            workspace->missingIndexes[j++] = i;
+        }
+    }
+    LC_ASSERT(j == missingPackets);
+    if (j != missingPackets) {
+        return -2;
     }
 
-    reed_solomon* rs = NULL;
-    unsigned char** packets = malloc(totalPackets * sizeof(unsigned char*));
-    unsigned char* marks = malloc(totalPackets * sizeof(unsigned char));
-    if (packets == NULL || marks == NULL) {
-        ret = -2;
-        goto cleanup;
+    // The missing data is recovered in place over the parity packets
+    // we folded, so recovery doesn't need to allocate anything.
+    for (i = 0; i < missingPackets; i++) {
+        entry = frame->bufferParity[i];
+        workspace->blocks[i] = (unsigned char*) entry->packet;
+        workspace->parityIndexes[i] = ushort(entry->packet->sequenceNumber - frame->bufferFirstParitySequenceNumber);
     }
-    
-    rs = reed_solomon_new(queue->bufferDataPackets, totalParityPackets);
-    
-    // This could happen in an OOM condition, but it could also mean the FEC data
-    // that we fed to reed_solomon_new() is bogus, so we'll assert to get a better look.
-    LC_ASSERT(rs != NULL);
-    if (rs == NULL) {
-        ret = -3;
-        goto cleanup;
+
+    ret = reed_solomon_factor(frame->bufferCodec, workspace->parityIndexes, workspace->missingIndexes,
+                              missingPackets, workspace->lu);
+    if (ret == 0) {
+        ret = solveFrame(queue, missingPackets, RTPF_FEC_OFFSET, frame->bufferFoldExtent);
     }
-    
-    rs->shards = queue->bufferDataPackets + missingPackets; //Don't let RS complain about missing parity packets
 
-    memset(marks, 1, sizeof(char) * (totalPackets));
-    
-    int receiveSize = StreamConfig.packetSize + MAX_RTP_HEADER_SIZE;
-    int packetBufferSize = receiveSize + sizeof(RTPFEC_QUEUE_ENTRY);
+    // We should always provide enough parity to recover the missing data successfully.
+    // If this fails, something is probably wrong with our FEC state.
+    LC_ASSERT(ret == 0);
+    if (ret != 0) {
+        return ret;
+    }
 
-    PRTPFEC_QUEUE_ENTRY entry = queue->bufferHead;
-    while (entry != NULL) {
-        int index = ushort(entry->packet->sequenceNumber - queue->bufferLowestSequenceNumber);
-        packets[index] = (unsigned char*) entry->packet;
-        marks[index] = 0;
-        
-        //Set padding to zero
-        if (entry->length < receiveSize) {
-            memset(&packets[index][entry->length], 0, receiveSize - entry->length);
+    for (i = 0; i < missingPackets; i++) {
+        entry = frame->bufferParity[i];
+        PRTP_PACKET rtpPacket = entry->packet;
+
+        // The first RTPF_FEC_OFFSET bytes aren't recovered. The header byte and packet
+        // type are still those of the parity packet from this stream, so only the
+        // sequence number needs filling in.
+        rtpPacket->sequenceNumber = ushort(workspace->missingIndexes[i] + frame->bufferLowestSequenceNumber);
+
+        int dataOffset = sizeof(*rtpPacket);
+        if (rtpPacket->header & FLAG_EXTENSION) {
+            dataOffset += 4; // 2 additional fields
+        }
+
+        PNV_VIDEO_PACKET nvPacket = (PNV_VIDEO_PACKET)(((char*)rtpPacket) + dataOffset);
+        nvPacket->frameIndex = frame->frameNumber;
+        nvPacket->multiFecBlocks = ((frame->multiFecLastBlockNumber << 2) | frame->multiFecCurrentBlockNumber) << 4;
+
+        // FEC recovered frames may have extra zero padding at the end. This is
+        // fine per H.264 Annex B which states trailing zero bytes must be
+        // discarded by decoders. It's not safe to strip all zero padding because
+        // it may be a legitimate part of the H.264 bytestream. Nothing past the
+        // longest packet we received can hold data though, so stop there.
+
+        LC_ASSERT(isBefore(rtpPacket->sequenceNumber, frame->bufferFirstParitySequenceNumber));
+
+        // This entry now holds frame data rather than parity
+        entry->length = frame->bufferFoldExtent;
+        entry->isParity = 0;
+        frame->bufferSlots[workspace->parityIndexes[i] + frame->bufferDataPackets] = NULL;
+        frame->bufferSlots[workspace->missingIndexes[i]] = entry;
+    }
+
+    frame->recovered = 1;
+    queue->stats.parityPacketsUsed += missingPackets;
+
+    return 0;
+}
+
+// Moves the undelivered data packets of a completed FEC block onto the block list
+// in sequence order and drops the rest, which are no longer needed
+static void completeBuffer(PRTP_FEC_QUEUE queue, PRTPF_FRAME frame) {
+    int i, span;
+
+    span = ushort(frame->bufferHighestSequenceNumber - frame->bufferLowestSequenceNumber);
+    if (span >= RTPF_BUFFER_SLOTS) {
+        span = RTPF_BUFFER_SLOTS - 1;
+    }
+
+    for (i = 0; i <= span; i++) {
+        PRTPFEC_QUEUE_ENTRY entry = frame->bufferSlots[i];
+        if (entry == NULL) {
+            continue;
+        }
+
+        frame->bufferSlots[i] = NULL;
+
+        if (i >= frame->bufferDeliveredPackets && i < frame->bufferDataPackets) {
+            LC_ASSERT(!entry->isParity);
+            appendEntries(&frame->blockHead, &frame->blockTail, entry, entry);
+            frame->blockSize++;
+        }
+        else {
+            RtpfReleasePacket(queue, entry);
+        }
+    }
+
+    frame->bufferSize = 0;
+}
+
+// Moves the completed FEC blocks a frame holds onto the end of the queue
+static void queueBlocks(PRTP_FEC_QUEUE queue, PRTPF_FRAME frame) {
+    appendEntries(&queue->queueHead, &queue->queueTail, frame->blockHead, frame->blockTail);
+    queue->queueSize += frame->blockSize;
+
+    frame->blockHead = NULL;
+    frame->blockTail = NULL;
+    frame->blockSize = 0;
+}
+
+// Moves the queue past a frame that has been delivered or given up on,
+// along with any completed or lost frames right behind it
+static void retireFrame(PRTP_FEC_QUEUE queue, PRTPF_FRAME frame) {
+    int i;
+
+    if (!isBefore(frame->frameNumber + 1, queue->currentFrameNumber)) {
+        queue->currentFrameNumber = frame->frameNumber + 1;
+        queue->nextRtpSequenceNumber = frame->bufferHighestSequenceNumber;
+    }
+
+    releaseFrame(queue, frame);
+
+    for (i = 0; i < RTPF_FRAME_WINDOW; i++) {
+        PRTPF_FRAME nextFrame = &queue->frames[i];
+
+        if (nextFrame->frameNumber != queue->currentFrameNumber) {
+            continue;
         }
 
-        entry = entry->next;
+        if (nextFrame->state == RTPF_FRAME_COMPLETE) {
+            queueBlocks(queue, nextFrame);
+            retireFrame(queue, nextFrame);
+            break;
+        }
+        else if (nextFrame->state == RTPF_FRAME_LOST) {
+            retireFrame(queue, nextFrame);
+            break;
+        }
     }
+}
 
+// Gives up on a frame as soon as we know it can't be completed and tells the
+// host, so recovery starts without waiting for later frames to show the loss.
+// The slot is held in the lost state to ignore the rest of the frame's packets
+// until the frames before it are done.
+static void dropFrame(PRTP_FEC_QUEUE queue, PRTPF_FRAME frame) {
+    if (frame->state != RTPF_FRAME_ASSEMBLING) {
+        return;
+    }
+
+    Limelog("Unrecoverable frame %d (FEC block %d): %d+%d=%d received < %d needed\n",
+            frame->frameNumber, frame->multiFecCurrentBlockNumber,
+            frame->receivedBufferDataPackets,
+            frame->bufferSize - frame->receivedBufferDataPackets,
+            frame->bufferSize,
+            frame->bufferDataPackets);
+
+    connectionDetectedFrameLoss(frame->frameNumber, frame->frameNumber);
+    queue->stats.framesUnrecoverable++;
+
+    discardBuffer(queue, frame);
+    discardHeldPackets(queue, frame);
+
+    frame->state = RTPF_FRAME_LOST;
+
+    if (frame->frameNumber == queue->currentFrameNumber) {
+        retireFrame(queue, frame);
+    }
+}
+
+// Gives up on a frame that newer frames can't wait for
+static void loseFrame(PRTP_FEC_QUEUE queue, PRTPF_FRAME frame) {
+    dropFrame(queue, frame);
+
+    if (frame->state != RTPF_FRAME_FREE) {
+        retireFrame(queue, frame);
+    }
+}
+
+// Delivers a completed frame without waiting any longer for the frames before
+// it. Older frames still in the window are delivered or given up on in order
+// and frames that never showed up at all are skipped.
+static void flushFrame(PRTP_FEC_QUEUE queue, PRTPF_FRAME frame) {
     int i;
-    for (i = 0; i < totalPackets; i++) {
-        if (marks[i]) {
-            packets[i] = malloc(packetBufferSize);
-            if (packets[i] == NULL) {
-                ret = -4;
-                goto cleanup_packets;
+
+    for (;;) {
+        PRTPF_FRAME olderFrame = NULL;
+
+        for (i = 0; i < RTPF_FRAME_WINDOW; i++) {
+            PRTPF_FRAME otherFrame = &queue->frames[i];
+            if (otherFrame->state != RTPF_FRAME_FREE && isBefore(otherFrame->frameNumber, frame->frameNumber) &&
+                    (olderFrame == NULL || isBefore(otherFrame->frameNumber, olderFrame->frameNumber))) {
+                olderFrame = otherFrame;
             }
         }
+
+        if (olderFrame == NULL) {
+            break;
+        }
+
+        if (olderFrame->state == RTPF_FRAME_COMPLETE) {
+            queueBlocks(queue, olderFrame);
+            retireFrame(queue, olderFrame);
+        }
+        else {
+            loseFrame(queue, olderFrame);
+        }
     }
-    
-    ret = reed_solomon_reconstruct(rs, packets, marks, totalPackets, receiveSize);
-    
-    // We should always provide enough parity to recover the missing data successfully.
-    // If this fails, something is probably wrong with our FEC state.
-    LC_ASSERT(ret == 0);
 
-cleanup_packets:
-    for (i = 0; i < totalPackets; i++) {
-        if (marks[i]) {
-            // Only submit frame data, not FEC packets
-            if (ret == 0 && i < queue->bufferDataPackets) {
-                PRTPFEC_QUEUE_ENTRY queueEntry = (PRTPFEC_QUEUE_ENTRY)&packets[i][receiveSize];
-                PRTP_PACKET rtpPacket = (PRTP_PACKET) packets[i];
-                rtpPacket->sequenceNumber = ushort(i + queue->bufferLowestSequenceNumber);
-                rtpPacket->header = queue->bufferHead->packet->header;
-                
-                int dataOffset = sizeof(*rtpPacket);
-                if (rtpPacket->header & FLAG_EXTENSION) {
-                    dataOffset += 4; // 2 additional fields
-                }
-
-                PNV_VIDEO_PACKET nvPacket = (PNV_VIDEO_PACKET)(((char*)rtpPacket) + dataOffset);
-                nvPacket->frameIndex = queue->currentFrameNumber;
-
-                // FEC recovered frames may have extra zero padding at the end. This is
-                // fine per H.264 Annex B which states trailing zero bytes must be
-                // discarded by decoders. It's not safe to strip all zero padding because
-                // it may be a legitimate part of the H.264 bytestream.
-
-                LC_ASSERT(isBefore(rtpPacket->sequenceNumber, queue->bufferFirstParitySequenceNumber));                
-                queuePacket(queue, queueEntry, 0, rtpPacket, StreamConfig.packetSize + dataOffset, 0);
-            } else if (packets[i] != NULL) {
-                free(packets[i]);
+    // Retiring the older frames may have delivered this one already
+    if (frame->state == RTPF_FRAME_COMPLETE) {
+        queueBlocks(queue, frame);
+        retireFrame(queue, frame);
+    }
+}
+
+// Gives up on frames that have gone quiet for far longer than their
+// packets usually take to arrive. Completed frames stop waiting on older
+// frames after as long, unless an older frame is still being assembled.
+static void checkDeadlines(PRTP_FEC_QUEUE queue, unsigned long long now) {
+    unsigned long long deadlineMs;
+    int i, j;
+
+    deadlineMs = ((unsigned long long)queue->interArrivalUs * RTPF_DEADLINE_INTERVALS) / 1000;
+    if (deadlineMs < RTPF_DEADLINE_MIN_MS) {
+        deadlineMs = RTPF_DEADLINE_MIN_MS;
+    }
+
+    for (i = 0; i < RTPF_FRAME_WINDOW; i++) {
+        PRTPF_FRAME frame = &queue->frames[i];
+
+        if (frame->state == RTPF_FRAME_ASSEMBLING && now > frame->lastReceiveTimeMs &&
+            now - frame->lastReceiveTimeMs > deadlineMs) {
+            Limelog("Frame %d timed out after %llu ms\n", frame->frameNumber, now - frame->lastReceiveTimeMs);
+            dropFrame(queue, frame);
+        }
+    }
+
+    for (i = 0; i < RTPF_FRAME_WINDOW; i++) {
+        PRTPF_FRAME frame = &queue->frames[i];
+
+        if (frame->state != RTPF_FRAME_COMPLETE || now <= frame->lastReceiveTimeMs ||
+                now - frame->lastReceiveTimeMs <= deadlineMs) {
+            continue;
+        }
+
+        for (j = 0; j < RTPF_FRAME_WINDOW; j++) {
+            if (queue->frames[j].state == RTPF_FRAME_ASSEMBLING &&
+                    isBefore(queue->frames[j].frameNumber, frame->frameNumber)) {
+                break;
             }
         }
+
+        if (j == RTPF_FRAME_WINDOW) {
+            flushFrame(queue, frame);
+        }
     }
+}
 
-cleanup:
-    reed_solomon_release(rs);
+// Returns non-zero if the FEC block being assembled can no longer be recovered
+// because more of its data is lost than the parity that could still arrive can
+// make up for. Packets too far behind the newest one received are taken as lost.
+static int isBlockUnrecoverable(PRTP_FEC_QUEUE queue, PRTPF_FRAME frame) {
+    int newestSequenceNumber = frame->bufferHighestSequenceNumber;
+    int totalParityPackets, lostBefore, i;
 
-    if (packets != NULL)
-        free(packets);
+    for (i = 0; i < RTPF_FRAME_WINDOW; i++) {
+        if (queue->frames[i].state != RTPF_FRAME_FREE &&
+                isBefore(newestSequenceNumber, queue->frames[i].bufferHighestSequenceNumber)) {
+            newestSequenceNumber = queue->frames[i].bufferHighestSequenceNumber;
+        }
+    }
 
-    if (marks != NULL)
-        free(marks);
-    
-    return ret;
+    totalParityPackets = (frame->bufferDataPackets * frame->fecPercentage + 99) / 100;
+
+    lostBefore = ushort(newestSequenceNumber - frame->bufferLowestSequenceNumber) - RTPF_REORDER_DISTANCE;
+    if (lostBefore > frame->bufferDataPackets + totalParityPackets) {
+        lostBefore = frame->bufferDataPackets + totalParityPackets;
+    }
+    if (lostBefore > RTPF_BUFFER_SLOTS) {
+        lostBefore = RTPF_BUFFER_SLOTS;
+    }
+
+    // Only newly passed packets need counting
+    for (; frame->bufferLossScanIndex < lostBefore; frame->bufferLossScanIndex++) {
+        if (frame->bufferSlots[frame->bufferLossScanIndex] == NULL) {
+            if (frame->bufferLossScanIndex < frame->bufferDataPackets) {
+                frame->bufferLostDataPackets++;
+            }
+            else {
+                frame->bufferLostParityPackets++;
+            }
+        }
+    }
+
+    return frame->bufferLostDataPackets > totalParityPackets - frame->bufferLostParityPackets;
 }
 
-static void removeEntry(PRTP_FEC_QUEUE queue, PRTPFEC_QUEUE_ENTRY entry) {
-    LC_ASSERT(entry != NULL);
-    LC_ASSERT(queue->queueSize > 0);
-    LC_ASSERT(queue->queueHead != NULL);
-    LC_ASSERT(queue->queueTail != NULL);
+// Queues a completed frame for delivery if every frame before it is done.
+// Otherwise the frame holds its slot until the older frames complete or are
+// given up on by eviction or their deadline, and is then delivered in order.
+static void completeFrame(PRTP_FEC_QUEUE queue, PRTPF_FRAME frame) {
+    unsigned long long latencyMs;
+    int bucket;
 
-    if (queue->queueHead == entry) {
-        queue->queueHead = entry->next;
+    // Bucket 0 is under 1 ms and each bucket after that doubles
+    latencyMs = frame->lastReceiveTimeMs - frame->firstReceiveTimeMs;
+    for (bucket = 0; latencyMs != 0 && bucket < FEC_LATENCY_BUCKETS - 1; bucket++) {
+        latencyMs >>= 1;
     }
-    if (queue->queueTail == entry) {
-        queue->queueTail = entry->prev;
+
+    if (frame->recovered) {
+        queue->stats.framesRecovered++;
+        queue->stats.recoveredLatencyHistogram[bucket]++;
+    }
+    else {
+        queue->stats.framesReceivedClean++;
+        queue->stats.cleanLatencyHistogram[bucket]++;
     }
 
-    if (entry->prev != NULL) {
-        entry->prev->next = entry->next;
+    if (frame->frameNumber == queue->currentFrameNumber) {
+        queueBlocks(queue, frame);
+        retireFrame(queue, frame);
     }
-    if (entry->next != NULL) {
-        entry->next->prev = entry->prev;
+    else {
+        frame->state = RTPF_FRAME_COMPLETE;
     }
-    queue->queueSize--;
 }
 
-int RtpfAddPacket(PRTP_FEC_QUEUE queue, PRTP_PACKET packet, int length, PRTPFEC_QUEUE_ENTRY packetEntry) {
+// Returns the window slot for a frame, starting it if it's new. A full window
+// makes room by delivering its oldest frame if that's complete or giving up on
+// it otherwise, unless the new frame is older still, in which case this
+// returns NULL.
+static PRTPF_FRAME getFrame(PRTP_FEC_QUEUE queue, int frameNumber, int sequenceNumber, unsigned long long receiveTimeNs) {
+    PRTPF_FRAME freeFrame = NULL;
+    PRTPF_FRAME oldestFrame = NULL;
+    int i;
+
+    for (i = 0; i < RTPF_FRAME_WINDOW; i++) {
+        PRTPF_FRAME frame = &queue->frames[i];
+
+        if (frame->state == RTPF_FRAME_FREE) {
+            if (freeFrame == NULL) {
+                freeFrame = frame;
+            }
+        }
+        else if (frame->frameNumber == frameNumber) {
+            return frame;
+        }
+        else if (oldestFrame == NULL || isBefore(frame->frameNumber, oldestFrame->frameNumber)) {
+            oldestFrame = frame;
+        }
+    }
+
+    if (freeFrame == NULL) {
+        if (isBefore(frameNumber, oldestFrame->frameNumber)) {
+            return NULL;
+        }
+
+        if (oldestFrame->state == RTPF_FRAME_COMPLETE) {
+            flushFrame(queue, oldestFrame);
+        }
+        else {
+            loseFrame(queue, oldestFrame);
+        }
+        freeFrame = oldestFrame;
+    }
+
+    LC_ASSERT(freeFrame->bufferSize == 0 && freeFrame->blockHead == NULL && freeFrame->pendingHead == NULL);
+
+    freeFrame->state = RTPF_FRAME_ASSEMBLING;
+    freeFrame->frameNumber = frameNumber;
+    freeFrame->multiFecCurrentBlockNumber = 0;
+    freeFrame->bufferHighestSequenceNumber = sequenceNumber;
+    freeFrame->firstReceiveTimeMs = receiveTimeNs / 1000000;
+    freeFrame->lastReceiveTimeMs = freeFrame->firstReceiveTimeMs;
+    freeFrame->lastReceiveTimeNs = 0;
+    freeFrame->recovered = 0;
+
+    return freeFrame;
+}
+
+// Hands data packets of the next frame to be delivered to the depacketizer as
+// soon as everything before them has been, instead of once the whole frame
+// is complete. The FEC block keeps its own reference to each packet since
+// it may still be needed to recover the rest of the block.
+static void deliverPackets(PRTP_FEC_QUEUE queue) {
+    PRTPF_FRAME frame = NULL;
+    int i;
+
+    for (i = 0; i < RTPF_FRAME_WINDOW; i++) {
+        if (queue->frames[i].state == RTPF_FRAME_ASSEMBLING &&
+                queue->frames[i].frameNumber == queue->currentFrameNumber) {
+            frame = &queue->frames[i];
+            break;
+        }
+    }
+
+    if (frame == NULL) {
+        return;
+    }
+
+    // Completed FEC blocks of this frame go first
+    queueBlocks(queue, frame);
+
+    while (frame->bufferSize != 0 && frame->bufferDeliveredPackets < frame->bufferDataPackets) {
+        PRTPFEC_QUEUE_ENTRY entry = frame->bufferSlots[frame->bufferDeliveredPackets];
+        if (entry == NULL) {
+            // The rest waits for this packet or its recovery
+            break;
+        }
+
+        entry->refCount++;
+        entry->next = NULL;
+        appendEntries(&queue->queueHead, &queue->queueTail, entry, entry);
+        queue->queueSize++;
+
+        frame->bufferDeliveredPackets++;
+    }
+}
+
+static int addFramePacket(PRTP_FEC_QUEUE queue, PRTPF_FRAME frame, PRTP_PACKET packet, int length,
+                          unsigned long long receiveTimeNs, PRTPFEC_QUEUE_ENTRY packetEntry);
+
+// Holds a packet of a later FEC block until the blocks before it are complete,
+// so a packet reordered across a block boundary doesn't cost the frame.
+// Returns 0 if the packet was rejected and is still owned by the caller.
+static int holdPacket(PRTP_FEC_QUEUE queue, PRTPF_FRAME frame, PRTP_PACKET packet, int length,
+                      unsigned long long receiveTimeNs, PRTPFEC_QUEUE_ENTRY packetEntry) {
+    if (frame->pendingSize >= RTPF_BUFFER_SLOTS) {
+        // A whole block's worth of packets has passed the block being assembled
+        Limelog("Frame %d is missing FEC block %d\n",
+                frame->frameNumber, frame->multiFecCurrentBlockNumber);
+
+        dropFrame(queue, frame);
+        return 0;
+    }
+
+    packetEntry->packet = packet;
+    packetEntry->length = length;
+    packetEntry->receiveTimeNs = receiveTimeNs;
+    packetEntry->receiveTimeMs = receiveTimeNs / 1000000;
+    packetEntry->refCount = 1;
+    packetEntry->next = NULL;
+
+    appendEntries(&frame->pendingHead, &frame->pendingTail, packetEntry, packetEntry);
+    frame->pendingSize++;
+
+    if (isBefore(frame->bufferHighestSequenceNumber, packet->sequenceNumber)) {
+        frame->bufferHighestSequenceNumber = packet->sequenceNumber;
+    }
+
+    // Packets this far ahead may show the block being assembled is lost
+    if (frame->bufferSize != 0 && isBlockUnrecoverable(queue, frame)) {
+        dropFrame(queue, frame);
+    }
+
+    return 1;
+}
+
+// Feeds the held packets back through a frame once the FEC block being
+// assembled has moved on. Packets of blocks after that one are held again.
+static void replayPackets(PRTP_FEC_QUEUE queue, PRTPF_FRAME frame) {
+    PRTPFEC_QUEUE_ENTRY entry = frame->pendingHead;
+
+    frame->pendingHead = NULL;
+    frame->pendingTail = NULL;
+    frame->pendingSize = 0;
+
+    while (entry != NULL) {
+        PRTPFEC_QUEUE_ENTRY next = entry->next;
+
+        // Completing a block along the way may finish or drop the frame
+        if (frame->state != RTPF_FRAME_ASSEMBLING ||
+                !addFramePacket(queue, frame, entry->packet, entry->length, entry->receiveTimeNs, entry)) {
+            RtpfReleasePacket(queue, entry);
+        }
+
+        entry = next;
+    }
+}
+
+// Adds a packet to the FEC block of a frame being assembled, or holds it if
+// it's for a later block. Returns 0 if the packet was rejected and is still
+// owned by the caller.
+static int addFramePacket(PRTP_FEC_QUEUE queue, PRTPF_FRAME frame, PRTP_PACKET packet, int length,
+                          unsigned long long receiveTimeNs, PRTPFEC_QUEUE_ENTRY packetEntry) {
+    PNV_VIDEO_PACKET nvPacket = getVideoPacket(packet);
+    int fecBlockNumber = (nvPacket->multiFecBlocks >> 4) & 0x3;
+
+    if (fecBlockNumber < frame->multiFecCurrentBlockNumber) {
+        // Reject FEC blocks we're done with
+        queue->stats.latePackets++;
+        return 0;
+    }
+    else if (fecBlockNumber > frame->multiFecCurrentBlockNumber) {
+        return holdPacket(queue, frame, packet, length, receiveTimeNs, packetEntry);
+    }
+
+    // Initialize the FEC block state if this is the first packet of a block
+    if (frame->bufferSize == 0) {
+        frame->bufferParityPackets = 0;
+        frame->bufferFoldExtent = RTPF_FEC_OFFSET;
+        frame->bufferCodec = NULL;
+
+        int fecIndex = (nvPacket->fecInfo & 0x3FF000) >> 12;
+        frame->bufferLowestSequenceNumber = ushort(packet->sequenceNumber - fecIndex);
+        frame->receivedBufferDataPackets = 0;
+        frame->bufferDataPackets = ((nvPacket->fecInfo & 0xFFF00000) >> 20) / 4;
+        frame->fecPercentage = ((nvPacket->fecInfo & 0xFF0) >> 4);
+        frame->bufferDeliveredPackets = 0;
+        frame->bufferLossScanIndex = 0;
+        frame->bufferLostDataPackets = 0;
+        frame->bufferLostParityPackets = 0;
+        frame->bufferFirstParitySequenceNumber = ushort(frame->bufferLowestSequenceNumber + frame->bufferDataPackets);
+        frame->multiFecLastBlockNumber = (nvPacket->multiFecBlocks >> 6) & 0x3;
+    }
+
+    // Held packets of later blocks count too, since they show how far the stream has moved on
+    if (isBefore(frame->bufferHighestSequenceNumber, packet->sequenceNumber)) {
+        frame->bufferHighestSequenceNumber = packet->sequenceNumber;
+    }
+
+    if (!queuePacket(queue, frame, packetEntry, packet, length, receiveTimeNs, !isBefore(packet->sequenceNumber, frame->bufferFirstParitySequenceNumber))) {
+        return 0;
+    }
+
+    // Track how far apart this frame's packets arrive to size the deadlines.
+    // The first packet of a frame has nothing to be measured against, and
+    // kernel timestamps can put a reordered packet before the last one.
+    if (frame->lastReceiveTimeNs == 0) {
+        frame->lastReceiveTimeMs = packetEntry->receiveTimeMs;
+        frame->lastReceiveTimeNs = packetEntry->receiveTimeNs;
+    }
+    else if (packetEntry->receiveTimeNs >= frame->lastReceiveTimeNs) {
+        queue->interArrivalUs += ((int)((packetEntry->receiveTimeNs - frame->lastReceiveTimeNs) / 1000) -
+                                  queue->interArrivalUs) / RTPF_INTERARRIVAL_WEIGHT;
+        frame->lastReceiveTimeMs = packetEntry->receiveTimeMs;
+        frame->lastReceiveTimeNs = packetEntry->receiveTimeNs;
+    }
+
+    foldPacket(queue, frame, packetEntry);
+
+    if (isBefore(packet->sequenceNumber, frame->bufferFirstParitySequenceNumber)) {
+        frame->receivedBufferDataPackets++;
+    }
+
+    // Try to submit this frame. If we haven't received enough packets,
+    // this will fail and we'll keep waiting.
+    if (reconstructFrame(queue, frame) == 0) {
+        // Hold this FEC block until the rest of the frame is complete
+        completeBuffer(queue, frame);
+
+        if (frame->multiFecCurrentBlockNumber < frame->multiFecLastBlockNumber) {
+            // Move on to the next FEC block of this frame, which may have started arriving already
+            frame->multiFecCurrentBlockNumber++;
+            replayPackets(queue, frame);
+        }
+        else {
+            completeFrame(queue, frame);
+        }
+    }
+    else if (isBlockUnrecoverable(queue, frame)) {
+        dropFrame(queue, frame);
+    }
+
+    return 1;
+}
+
+int RtpfAddPacket(PRTP_FEC_QUEUE queue, PRTP_PACKET packet, int length, unsigned long long receiveTimeNs,
+                  PRTPFEC_QUEUE_ENTRY packetEntry) {
+    PRTPF_FRAME frame;
+
     if (isBefore(packet->sequenceNumber, queue->nextRtpSequenceNumber)) {
         // Reject packets behind our current sequence number
+        queue->stats.latePackets++;
         return RTPF_RET_REJECTED;
     }
 
-    int dataOffset = sizeof(*packet);
-    if (packet->header & FLAG_EXTENSION) {
-        dataOffset += 4; // 2 additional fields
+    PNV_VIDEO_PACKET nvPacket = getVideoPacket(packet);
+
+    if (!queue->receivedFirstPacket) {
+        queue->currentFrameNumber = nvPacket->frameIndex;
+        queue->receivedFirstPacket = 1;
     }
 
-    PNV_VIDEO_PACKET nvPacket = (PNV_VIDEO_PACKET)(((char*)packet) + dataOffset);
-    
     if (isBefore(nvPacket->frameIndex, queue->currentFrameNumber)) {
         // Reject frames behind our current frame number
+        queue->stats.latePackets++;
         return RTPF_RET_REJECTED;
     }
-    
-    // Reinitialize the queue if it's empty after a frame delivery or
-    // if we can't finish a frame before receiving the next one.
-    if (queue->bufferSize == 0 || queue->currentFrameNumber != nvPacket->frameIndex) {
-        if (queue->currentFrameNumber != nvPacket->frameIndex && queue->bufferSize != 0) {
-            Limelog("Unrecoverable frame %d: %d+%d=%d received < %d needed\n",
-                    queue->currentFrameNumber, queue->receivedBufferDataPackets,
-                    queue->bufferSize - queue->receivedBufferDataPackets,
-                    queue->bufferSize,
-                    queue->bufferDataPackets);
-        }
-        
-        queue->currentFrameNumber = nvPacket->frameIndex;
-        queue->nextRtpSequenceNumber = queue->bufferHighestSequenceNumber;
-        
-        // Discard any unsubmitted buffers from the previous frame
-        while (queue->bufferHead != NULL) {
-            PRTPFEC_QUEUE_ENTRY entry = queue->bufferHead;
-            queue->bufferHead = entry->next;
-            free(entry->packet);
-        }
-        
-        queue->bufferTail = NULL;
-        queue->bufferSize = 0;
-        
-        int fecIndex = (nvPacket->fecInfo & 0xFF000) >> 12;
-        queue->bufferLowestSequenceNumber = ushort(packet->sequenceNumber - fecIndex);
-        queue->receivedBufferDataPackets = 0;
-        queue->bufferHighestSequenceNumber = packet->sequenceNumber;
-        queue->bufferDataPackets = ((nvPacket->fecInfo & 0xFFF00000) >> 20) / 4;
-        queue->fecPercentage = ((nvPacket->fecInfo & 0xFF0) >> 4);
-        queue->bufferFirstParitySequenceNumber = ushort(queue->bufferLowestSequenceNumber + queue->bufferDataPackets);
-    } else if (isBefore(queue->bufferHighestSequenceNumber, packet->sequenceNumber)) {
-        queue->bufferHighestSequenceNumber = packet->sequenceNumber;
+
+    frame = getFrame(queue, nvPacket->frameIndex, packet->sequenceNumber, receiveTimeNs);
+    if (frame == NULL) {
+        // Too far behind the frames we're assembling to be worth keeping
+        queue->stats.latePackets++;
+        return RTPF_RET_REJECTED;
     }
-    
-    if (!queuePacket(queue, packetEntry, 0, packet, length, !isBefore(packet->sequenceNumber, queue->bufferFirstParitySequenceNumber))) {
+
+    if (frame->state != RTPF_FRAME_ASSEMBLING) {
+        // Reject frames we've completed or given up on
+        queue->stats.latePackets++;
         return RTPF_RET_REJECTED;
     }
-    else {
-        if (isBefore(packet->sequenceNumber, queue->bufferFirstParitySequenceNumber)) {
-            queue->receivedBufferDataPackets++;
-        }
-        
-        // Try to submit this frame. If we haven't received enough packets,
-        // this will fail and we'll keep waiting.
-        if (reconstructFrame(queue) == 0) {
-            // Queue the pending frame data
-            if (queue->queueTail == NULL) {
-                queue->queueHead = queue->bufferHead;
-                queue->queueTail = queue->bufferTail;
-            } else {
-                queue->queueTail->next = queue->bufferHead;
-                queue->queueTail = queue->bufferTail;
-            }
-            queue->queueSize += queue->bufferSize;
-            
-            // Clear the buffer list
-            queue->bufferHead = NULL;
-            queue->bufferTail = NULL;
-            queue->bufferSize = 0;
-            
-            // Ignore any more packets for this frame
-            queue->currentFrameNumber++;
-        }
 
-        return (queue->queueHead != NULL) ? RTPF_RET_QUEUED_PACKETS_READY : RTPF_RET_QUEUED_NOTHING_READY;
+    if (!addFramePacket(queue, frame, packet, length, receiveTimeNs, packetEntry)) {
+        return RTPF_RET_REJECTED;
     }
+
+    checkDeadlines(queue, receiveTimeNs / 1000000);
+
+    deliverPackets(queue);
+
+    return (queue->queueHead != NULL) ? RTPF_RET_QUEUED_PACKETS_READY : RTPF_RET_QUEUED_NOTHING_READY;
 }
 
 PRTPFEC_QUEUE_ENTRY RtpfGetQueuedPacket(PRTP_FEC_QUEUE queue) {
-    PRTPFEC_QUEUE_ENTRY queuedEntry, entry;
+    PRTPFEC_QUEUE_ENTRY queuedEntry;
 
-    // Find the next queued packet
-    queuedEntry = NULL;
-    entry = queue->queueHead;
-    unsigned int lowestRtpSequenceNumber = UINT16_MAX;
-    
-    while (entry != NULL) {
-        // Never return parity packets
-        if (entry->isParity) {
-            PRTPFEC_QUEUE_ENTRY parityEntry = entry;
-            
-            // Skip this entry
-            entry = parityEntry->next;
-            
-            // Remove this entry
-            removeEntry(queue, parityEntry);
-            
-            // Free the entry and packet
-            free(parityEntry->packet);
-            
-            continue;
-        }
-        
-        if (queuedEntry == NULL || isBefore(entry->packet->sequenceNumber, lowestRtpSequenceNumber)) {
-            lowestRtpSequenceNumber = entry->packet->sequenceNumber;
-            queuedEntry = entry;
-        }
+    // Frame data is queued in sequence order without parity packets
+    queuedEntry = queue->queueHead;
+    if (queuedEntry == NULL) {
+        return NULL;
+    }
 
-        entry = entry->next;
+    queue->queueHead = queuedEntry->next;
+    if (queue->queueHead == NULL) {
+        queue->queueTail = NULL;
     }
+    queue->queueSize--;
 
-    if (queuedEntry != NULL) {
-        removeEntry(queue, queuedEntry);
-        queuedEntry->prev = queuedEntry->next = NULL;
-        return queuedEntry;
-    } else {
-        return NULL;
+    queuedEntry->next = NULL;
+    return queuedEntry;
+}
+
+// Takes another reference to a delivered queue entry, keeping its packet
+// buffer alive until the matching RtpfReleasePacket()
+void RtpfRetainPacket(PRTP_FEC_QUEUE queue, PRTPFEC_QUEUE_ENTRY entry) {
+    PltLockMutex(&queue->refMutex);
+    LC_ASSERT(entry->refCount > 0);
+    entry->refCount++;
+    PltUnlockMutex(&queue->refMutex);
+}
+
+// Drops a reference to a queue entry, returning its packet buffer to
+// the pool once nothing holds it anymore
+void RtpfReleasePacket(PRTP_FEC_QUEUE queue, PRTPFEC_QUEUE_ENTRY entry) {
+    int refCount;
+
+    PltLockMutex(&queue->refMutex);
+    LC_ASSERT(entry->refCount > 0);
+    refCount = --entry->refCount;
+    PltUnlockMutex(&queue->refMutex);
+
+    if (refCount == 0) {
+        BpFreeBuffer(queue->pool, entry->packet);
     }
 }
+
+void RtpfGetStats(PRTP_FEC_QUEUE queue, PFEC_STATS stats) {
+    memcpy(stats, &queue->stats, sizeof(*stats));
+}
@@ -1,24 +1,97 @@
 #pragma once
 
 #include "Video.h"
+#include "PlatformThreads.h"
+#include "BufferPool.h"
+#include "rs.h"
+
+// Number of RS codecs kept around for reuse across frames
+#define RTPF_CODEC_CACHE_SIZE 16
+
+// Packets of one FEC block the queue can slot by sequence number. Must be
+// a power of two and covers the most data packets fecInfo can describe.
+#define RTPF_BUFFER_SLOTS 1024
+
+// Number of frames that can be assembled at once
+#define RTPF_FRAME_WINDOW 3
+
+// A frame is given up on once none of its packets have arrived for this many
+// average packet inter-arrival times, or the minimum if that's longer
+#define RTPF_DEADLINE_INTERVALS 64
+#define RTPF_DEADLINE_MIN_MS 10
+
+// Packets this far behind the newest one received are taken as lost
+// when deciding whether a frame can still be recovered
+#define RTPF_REORDER_DISTANCE 16
+
+// Weight of each new sample in the inter-arrival average is 1/this
+#define RTPF_INTERARRIVAL_WEIGHT 16
+
+// Upper bound on StreamConfig.fecWorkerThreads
+#define RTPF_MAX_WORKERS 8
+
+// Scratch space for recovering a frame, so recovery needs no heap
+// allocations and only a little stack
+typedef struct _RTPF_WORKSPACE {
+    unsigned char lu[DATA_SHARDS_MAX * DATA_SHARDS_MAX];
+    unsigned char* blocks[DATA_SHARDS_MAX];
+    unsigned int parityIndexes[DATA_SHARDS_MAX];
+    unsigned int missingIndexes[DATA_SHARDS_MAX];
+} RTPF_WORKSPACE, *PRTPF_WORKSPACE;
+
+// Recovery of a frame, split by byte range across the workers
+typedef struct _RTPF_SOLVE_JOB {
+    unsigned char* lu;
+    unsigned char** blocks;
+    int count;
+} RTPF_SOLVE_JOB, *PRTPF_SOLVE_JOB;
+
+typedef struct _RTPF_WORKER {
+    PLT_THREAD thread;
+    PLT_EVENT workEvent;
+    PLT_EVENT doneEvent;
+    PRTPF_SOLVE_JOB job;
+    int offset;
+    int end;
+    int ret;
+} RTPF_WORKER, *PRTPF_WORKER;
 
 typedef struct _RTPFEC_QUEUE_ENTRY {
     PRTP_PACKET packet;
     int length;
     int isParity;
     unsigned long long receiveTimeMs;
+    unsigned long long receiveTimeNs;
+
+    // Held by the FEC block and, once delivered, by the consumer and
+    // any decode units that point into the packet. Guarded by refMutex
+    // once the entry has been delivered.
+    int refCount;
 
     struct _RTPFEC_QUEUE_ENTRY* next;
-    struct _RTPFEC_QUEUE_ENTRY* prev;
 } RTPFEC_QUEUE_ENTRY, *PRTPFEC_QUEUE_ENTRY;
 
-typedef struct _RTP_FEC_QUEUE {
-    PRTPFEC_QUEUE_ENTRY queueHead;
-    PRTPFEC_QUEUE_ENTRY queueTail;
-    int queueSize;
+// A frame being assembled in the window
+#define RTPF_FRAME_FREE       0
+#define RTPF_FRAME_ASSEMBLING 1
+#define RTPF_FRAME_LOST       2
+#define RTPF_FRAME_COMPLETE   3
+
+typedef struct _RTPF_FRAME {
+    int state;
+    int frameNumber;
+    int multiFecCurrentBlockNumber;
+    int multiFecLastBlockNumber;
+    unsigned long long firstReceiveTimeMs;
+    unsigned long long lastReceiveTimeMs;
+    // Zero until a packet of the frame has been queued
+    unsigned long long lastReceiveTimeNs;
+    // Some FEC block of this frame had to be recovered
+    int recovered;
 
-    PRTPFEC_QUEUE_ENTRY bufferHead;
-    PRTPFEC_QUEUE_ENTRY bufferTail;
+    // Packets of the FEC block being assembled, indexed by
+    // sequenceNumber - bufferLowestSequenceNumber
+    PRTPFEC_QUEUE_ENTRY bufferSlots[RTPF_BUFFER_SLOTS];
     int bufferSize;
     int bufferLowestSequenceNumber;
     int bufferHighestSequenceNumber;
@@ -26,16 +99,78 @@ typedef struct _RTP_FEC_QUEUE {
     int bufferDataPackets;
     int receivedBufferDataPackets;
     int fecPercentage;
+    // Data packets of this block already delivered ahead of its completion
+    int bufferDeliveredPackets;
+    // Missing packets below the scan index are taken as lost
+    int bufferLossScanIndex;
+    int bufferLostDataPackets;
+    int bufferLostParityPackets;
 
+    // Parity packets that all received data has been folded into, in arrival order
+    PRTPFEC_QUEUE_ENTRY bufferParity[DATA_SHARDS_MAX];
+    int bufferParityPackets;
+    // Folded parity packets are valid up to this many bytes
+    int bufferFoldExtent;
+    reed_solomon* bufferCodec;
+
+    // Completed FEC blocks of this frame, held until its last block completes
+    // and every frame before it has been delivered or given up on
+    PRTPFEC_QUEUE_ENTRY blockHead;
+    PRTPFEC_QUEUE_ENTRY blockTail;
+    int blockSize;
+
+    // Packets of later FEC blocks that arrived before the block being
+    // assembled completed, in arrival order
+    PRTPFEC_QUEUE_ENTRY pendingHead;
+    PRTPFEC_QUEUE_ENTRY pendingTail;
+    int pendingSize;
+} RTPF_FRAME, *PRTPF_FRAME;
+
+typedef struct _RTP_FEC_QUEUE {
+    // Frame data ready for the depacketizer, in sequence order
+    PRTPFEC_QUEUE_ENTRY queueHead;
+    PRTPFEC_QUEUE_ENTRY queueTail;
+    int queueSize;
+
+    // Frames that are assembled concurrently, so packets reordered
+    // across a frame boundary don't cost the earlier frame
+    RTPF_FRAME frames[RTPF_FRAME_WINDOW];
+
+    // Frames before this one have been delivered or given up on. It starts
+    // at the frame of the first packet received.
     int currentFrameNumber;
+    int receivedFirstPacket;
     unsigned int nextRtpSequenceNumber;
+
+    // Average time between packets of the same frame
+    int interArrivalUs;
+
+    FEC_STATS stats;
+
+    // Most recently used first
+    reed_solomon* codecCache[RTPF_CODEC_CACHE_SIZE];
+
+    RTPF_WORKSPACE workspace;
+    RTPF_SOLVE_JOB solveJob;
+    RTPF_WORKER workers[RTPF_MAX_WORKERS];
+    int workerCount;
+
+    // Packet buffers are returned here once the queue is done with them
+    PBUFFER_POOL pool;
+
+    // Delivered packets may be released from the decoder thread
+    PLT_MUTEX refMutex;
 } RTP_FEC_QUEUE, *PRTP_FEC_QUEUE;
 
 #define RTPF_RET_QUEUED_NOTHING_READY 0
 #define RTPF_RET_QUEUED_PACKETS_READY 1
 #define RTPF_RET_REJECTED             2
 
-void RtpfInitializeQueue(PRTP_FEC_QUEUE queue);
+void RtpfInitializeQueue(PRTP_FEC_QUEUE queue, PBUFFER_POOL pool);
 void RtpfCleanupQueue(PRTP_FEC_QUEUE queue);
-int RtpfAddPacket(PRTP_FEC_QUEUE queue, PRTP_PACKET packet, int length, PRTPFEC_QUEUE_ENTRY packetEntry);
+int RtpfAddPacket(PRTP_FEC_QUEUE queue, PRTP_PACKET packet, int length, unsigned long long receiveTimeNs,
+                  PRTPFEC_QUEUE_ENTRY packetEntry);
 PRTPFEC_QUEUE_ENTRY RtpfGetQueuedPacket(PRTP_FEC_QUEUE queue);
+void RtpfRetainPacket(PRTP_FEC_QUEUE queue, PRTPFEC_QUEUE_ENTRY entry);
+void RtpfReleasePacket(PRTP_FEC_QUEUE queue, PRTPFEC_QUEUE_ENTRY entry);
+void RtpfGetStats(PRTP_FEC_QUEUE queue, PFEC_STATS stats);
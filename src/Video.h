@@ -7,6 +7,9 @@ typedef struct _QUEUED_DECODE_UNIT {
     LINKED_BLOCKING_QUEUE_ENTRY entry;
 } QUEUED_DECODE_UNIT, *PQUEUED_DECODE_UNIT;
 
+// Decode units waiting for the decoder before the queue overflows
+#define DECODE_UNIT_QUEUE_SIZE 15
+
 void freeQueuedDecodeUnit(PQUEUED_DECODE_UNIT qdu);
 int getNextQueuedDecodeUnit(PQUEUED_DECODE_UNIT* qdu);
 
@@ -20,7 +23,10 @@ typedef struct _NV_VIDEO_PACKET {
     int streamPacketIndex;
     int frameIndex;
     char flags;
-    char reserved[3];
+    char reserved;
+    unsigned char multiFecFlags;
+    // Bits 4-5 are this FEC block, bits 6-7 are the last FEC block of the frame
+    unsigned char multiFecBlocks;
     int fecInfo;
 } NV_VIDEO_PACKET, *PNV_VIDEO_PACKET;
 
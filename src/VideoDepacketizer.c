@@ -4,8 +4,16 @@
 #include "Video.h"
 
 static PLENTRY nalChainHead;
+static PLENTRY nalChainTail;
 static int nalChainDataLength;
 
+// Fragments point into the packets they came from, which are held
+// in this queue until the decode unit is freed
+static PRTP_FEC_QUEUE packetQueue;
+
+// Set if frames are copied into a single frame buffer instead
+static int contiguousFrames;
+
 static int nextFrameNumber;
 static int startFrameNumber;
 static int waitingForNextSuccessfulFrame;
@@ -14,6 +22,7 @@ static int lastPacketInStream;
 static int decodingFrame;
 static int strictIdrFrameWait;
 static unsigned long long firstPacketReceiveTime;
+static unsigned long long lastPacketReceiveTime;
 
 #define CONSECUTIVE_DROP_LIMIT 120
 static int consecutiveFrameDrops;
@@ -26,10 +35,51 @@ typedef struct _BUFFER_DESC {
     unsigned int length;
 } BUFFER_DESC, *PBUFFER_DESC;
 
+// A buffer chain entry along with the packet its data lives in
+typedef struct _PACKET_FRAGMENT {
+    LENTRY entry;
+    PRTPFEC_QUEUE_ENTRY queueEntry;
+} PACKET_FRAGMENT, *PPACKET_FRAGMENT;
+
+// Buffer chain entries, so queueing a fragment doesn't allocate
+static BUFFER_POOL fragmentPool;
+
+// A whole frame in one allocation, with the data following the header.
+// These are recycled once the decoder frees the decode unit and grow to
+// fit the largest frame seen so far.
+typedef struct _FRAME_BUFFER {
+    LENTRY entry;
+    int capacity;
+    struct _FRAME_BUFFER* nextFree;
+} FRAME_BUFFER, *PFRAME_BUFFER;
+
+// Size of the first frame buffers, before we've seen any frames
+#define FRAME_BUFFER_INITIAL_SIZE (256 * 1024)
+
+// Free frame buffers kept around for reuse
+#define FRAME_BUFFER_MAX_FREE 4
+
+static PLT_MUTEX frameBufferMutex;
+static PFRAME_BUFFER freeFrameBuffers;
+static int freeFrameBufferCount;
+static int maxFrameSize;
+
 // Init
-void initializeVideoDepacketizer(int pktSize) {
+void initializeVideoDepacketizer(int pktSize, PRTP_FEC_QUEUE queue, int packetCount) {
+    packetQueue = queue;
+    contiguousFrames = (VideoCallbacks.capabilities & CAPABILITY_CONTIGUOUS_DECODE_UNITS) != 0;
+
+    // Most packets hold a single fragment. Packets split around start codes
+    // can run the pool dry, which falls back to the heap.
+    BpInitializePool(&fragmentPool, sizeof(PACKET_FRAGMENT), contiguousFrames ? 0 : packetCount);
+
+    PltCreateMutex(&frameBufferMutex);
+    freeFrameBuffers = NULL;
+    freeFrameBufferCount = 0;
+    maxFrameSize = FRAME_BUFFER_INITIAL_SIZE;
+
     if ((VideoCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
-        LbqInitializeLinkedBlockingQueue(&decodeUnitQueue, 15);
+        LbqInitializeLinkedBlockingQueue(&decodeUnitQueue, DECODE_UNIT_QUEUE_SIZE);
     }
 
     nextFrameNumber = 1;
@@ -39,6 +89,7 @@ void initializeVideoDepacketizer(int pktSize) {
     lastPacketInStream = -1;
     decodingFrame = 0;
     firstPacketReceiveTime = 0;
+    lastPacketReceiveTime = 0;
 
     LC_ASSERT(NegotiatedVideoFormat != 0);
     strictIdrFrameWait =
@@ -46,16 +97,80 @@ void initializeVideoDepacketizer(int pktSize) {
               ((NegotiatedVideoFormat == VIDEO_FORMAT_H265 && (VideoCallbacks.capabilities & CAPABILITY_REFERENCE_FRAME_INVALIDATION_HEVC))));
 }
 
-// Free the NAL chain
-static void cleanupFrameState(void) {
-    PLENTRY lastEntry;
+// Takes a recycled frame buffer, or allocates one if none are free
+static PFRAME_BUFFER allocFrameBuffer(void) {
+    PFRAME_BUFFER frameBuffer;
+
+    PltLockMutex(&frameBufferMutex);
+    frameBuffer = freeFrameBuffers;
+    if (frameBuffer != NULL) {
+        freeFrameBuffers = frameBuffer->nextFree;
+        freeFrameBufferCount--;
+    }
+    PltUnlockMutex(&frameBufferMutex);
+
+    // Replace buffers smaller than the largest frame up front, so frames
+    // rarely need to be moved mid-assembly
+    if (frameBuffer != NULL && frameBuffer->capacity < maxFrameSize) {
+        free(frameBuffer);
+        frameBuffer = NULL;
+    }
+
+    if (frameBuffer == NULL) {
+        frameBuffer = (PFRAME_BUFFER)malloc(sizeof(*frameBuffer) + maxFrameSize + DECODE_UNIT_PADDING);
+        if (frameBuffer == NULL) {
+            return NULL;
+        }
+
+        frameBuffer->capacity = maxFrameSize;
+    }
+
+    frameBuffer->entry.next = NULL;
+    frameBuffer->entry.data = (char*)(frameBuffer + 1);
+    frameBuffer->entry.length = 0;
+    return frameBuffer;
+}
+
+// Returns a frame buffer for reuse. This may be called from the decoder thread.
+static void freeFrameBuffer(PFRAME_BUFFER frameBuffer) {
+    PltLockMutex(&frameBufferMutex);
+    if (freeFrameBufferCount < FRAME_BUFFER_MAX_FREE) {
+        frameBuffer->nextFree = freeFrameBuffers;
+        freeFrameBuffers = frameBuffer;
+        freeFrameBufferCount++;
+        frameBuffer = NULL;
+    }
+    PltUnlockMutex(&frameBufferMutex);
+
+    free(frameBuffer);
+}
+
+// Free a buffer chain and release the packets it points into
+static void freeBufferList(PLENTRY entry) {
+    PPACKET_FRAGMENT fragment;
+
+    if (contiguousFrames) {
+        if (entry != NULL) {
+            freeFrameBuffer((PFRAME_BUFFER)entry);
+        }
+        return;
+    }
+
+    while (entry != NULL) {
+        fragment = (PPACKET_FRAGMENT)entry;
+        entry = entry->next;
 
-    while (nalChainHead != NULL) {
-        lastEntry = nalChainHead;
-        nalChainHead = lastEntry->next;
-        free(lastEntry);
+        RtpfReleasePacket(packetQueue, fragment->queueEntry);
+        BpFreeBuffer(&fragmentPool, fragment);
     }
+}
+
+// Free the NAL chain
+static void cleanupFrameState(void) {
+    freeBufferList(nalChainHead);
 
+    nalChainHead = NULL;
+    nalChainTail = NULL;
     nalChainDataLength = 0;
 }
 
@@ -110,6 +225,17 @@ void destroyVideoDepacketizer(void) {
     }
 
     cleanupFrameState();
+
+    while (freeFrameBuffers != NULL) {
+        PFRAME_BUFFER frameBuffer = freeFrameBuffers;
+        freeFrameBuffers = frameBuffer->nextFree;
+        free(frameBuffer);
+    }
+    freeFrameBufferCount = 0;
+
+    PltDeleteMutex(&frameBufferMutex);
+
+    BpDestroyPool(&fragmentPool);
 }
 
 // Returns 1 if candidate is a frame start and 0 otherwise
@@ -177,14 +303,7 @@ int getNextQueuedDecodeUnit(PQUEUED_DECODE_UNIT* qdu) {
 
 // Cleanup a decode unit by freeing the buffer chain and the holder
 void freeQueuedDecodeUnit(PQUEUED_DECODE_UNIT qdu) {
-    PLENTRY lastEntry;
-
-    while (qdu->decodeUnit.bufferList != NULL) {
-        lastEntry = qdu->decodeUnit.bufferList;
-        qdu->decodeUnit.bufferList = lastEntry->next;
-        free(lastEntry);
-    }
-
+    freeBufferList(qdu->decodeUnit.bufferList);
     free(qdu);
 }
 
@@ -224,12 +343,25 @@ static void reassembleFrame(int frameNumber) {
     if (nalChainHead != NULL) {
         PQUEUED_DECODE_UNIT qdu = (PQUEUED_DECODE_UNIT)malloc(sizeof(*qdu));
         if (qdu != NULL) {
+            if (contiguousFrames) {
+                memset(&nalChainHead->data[nalChainHead->length], 0, DECODE_UNIT_PADDING);
+            }
+
             qdu->decodeUnit.bufferList = nalChainHead;
             qdu->decodeUnit.fullLength = nalChainDataLength;
             qdu->decodeUnit.frameNumber = frameNumber;
-            qdu->decodeUnit.receiveTimeMs = firstPacketReceiveTime;
+#if defined(LC_WINDOWS)
+            // receiveTimeMs stays on the GetTickCount64() clock clients already compare
+            // it against, so carry the first packet's age over from the QPC clock
+            qdu->decodeUnit.receiveTimeMs = PltGetMillis() - (PltGetNanos() - firstPacketReceiveTime) / 1000000;
+#else
+            qdu->decodeUnit.receiveTimeMs = firstPacketReceiveTime / 1000000;
+#endif
+            qdu->decodeUnit.firstPacketReceiveTimeNs = firstPacketReceiveTime;
+            qdu->decodeUnit.lastPacketReceiveTimeNs = lastPacketReceiveTime;
 
             nalChainHead = NULL;
+            nalChainTail = NULL;
             nalChainDataLength = 0;
 
             if ((VideoCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
@@ -237,6 +369,7 @@ static void reassembleFrame(int frameNumber) {
                     Limelog("Video decode unit queue overflow\n");
 
                     // Clear frame state and wait for an IDR
+                    // The whole chain is freed so the tail isn't needed
                     nalChainHead = qdu->decodeUnit.bufferList;
                     nalChainDataLength = qdu->decodeUnit.fullLength;
                     dropFrameState();
@@ -272,34 +405,85 @@ static void reassembleFrame(int frameNumber) {
     }
 }
 
-static void queueFragment(char*data, int offset, int length) {
-    PLENTRY entry = (PLENTRY)malloc(sizeof(*entry) + length);
-    if (entry != NULL) {
-        entry->next = NULL;
-        entry->length = length;
-        entry->data = (char*)(entry + 1);
+// Copies a fragment onto the end of the frame buffer, growing it if this
+// frame is the largest yet
+static void queueFragmentContiguous(char* data, int offset, int length) {
+    PFRAME_BUFFER frameBuffer = (PFRAME_BUFFER)nalChainHead;
 
-        memcpy(entry->data, &data[offset], entry->length);
+    if (frameBuffer == NULL) {
+        frameBuffer = allocFrameBuffer();
+        if (frameBuffer == NULL) {
+            return;
+        }
+    }
+    else if (frameBuffer->entry.length + length > frameBuffer->capacity) {
+        int capacity = frameBuffer->capacity * 2;
+        PFRAME_BUFFER newBuffer;
 
-        nalChainDataLength += entry->length;
+        if (capacity < frameBuffer->entry.length + length) {
+            capacity = frameBuffer->entry.length + length;
+        }
 
-        if (nalChainHead == NULL) {
-            nalChainHead = entry;
+        newBuffer = (PFRAME_BUFFER)realloc(frameBuffer, sizeof(*frameBuffer) + capacity + DECODE_UNIT_PADDING);
+        if (newBuffer == NULL) {
+            return;
         }
-        else {
-            PLENTRY currentEntry = nalChainHead;
 
-            while (currentEntry->next != NULL) {
-                currentEntry = currentEntry->next;
-            }
+        frameBuffer = newBuffer;
+        frameBuffer->capacity = capacity;
+        frameBuffer->entry.data = (char*)(frameBuffer + 1);
+    }
+
+    memcpy(&frameBuffer->entry.data[frameBuffer->entry.length], &data[offset], length);
+    frameBuffer->entry.length += length;
+
+    nalChainHead = &frameBuffer->entry;
+    nalChainTail = nalChainHead;
+    nalChainDataLength += length;
+
+    if (nalChainDataLength > maxFrameSize) {
+        maxFrameSize = nalChainDataLength;
+    }
+}
 
-            currentEntry->next = entry;
+// Appends a fragment to the NAL chain without copying it. The fragment
+// holds a reference to the packet that contains it.
+static void queueFragment(PRTPFEC_QUEUE_ENTRY queueEntry, char* data, int offset, int length) {
+    PPACKET_FRAGMENT fragment;
+
+    if (length == 0) {
+        return;
+    }
+
+    if (contiguousFrames) {
+        queueFragmentContiguous(data, offset, length);
+        return;
+    }
+
+    fragment = (PPACKET_FRAGMENT)BpAllocBuffer(&fragmentPool);
+    if (fragment != NULL) {
+        fragment->entry.next = NULL;
+        fragment->entry.length = length;
+        fragment->entry.data = &data[offset];
+        fragment->queueEntry = queueEntry;
+
+        RtpfRetainPacket(packetQueue, queueEntry);
+
+        nalChainDataLength += length;
+
+        if (nalChainHead == NULL) {
+            nalChainHead = &fragment->entry;
         }
+        else {
+            nalChainTail->next = &fragment->entry;
+        }
+        nalChainTail = &fragment->entry;
     }
 }
 
 // Process an RTP Payload
-static void processRtpPayloadSlow(PNV_VIDEO_PACKET videoPacket, PBUFFER_DESC currentPos) {
+static void processRtpPayloadSlow(PNV_VIDEO_PACKET videoPacket, PBUFFER_DESC currentPos,
+                                  PRTPFEC_QUEUE_ENTRY queueEntry) {
     BUFFER_DESC specialSeq;
     int decodingVideo = 0;
 
@@ -361,7 +545,7 @@ static void processRtpPayloadSlow(PNV_VIDEO_PACKET videoPacket, PBUFFER_DESC cur
         }
 
         if (decodingVideo) {
-            queueFragment(currentPos->data, start, currentPos->offset - start);
+            queueFragment(queueEntry, currentPos->data, start, currentPos->offset - start);
         }
     }
 }
@@ -393,22 +577,19 @@ static int isFirstPacket(char flags) {
 }
 
 // Adds a fragment directly to the queue
-static void processRtpPayloadFast(BUFFER_DESC location) {
-    queueFragment(location.data, location.offset, location.length);
+static void processRtpPayloadFast(BUFFER_DESC location, PRTPFEC_QUEUE_ENTRY queueEntry) {
+    queueFragment(queueEntry, location.data, location.offset, location.length);
 }
 
 // Process an RTP Payload
-void processRtpPayload(PNV_VIDEO_PACKET videoPacket, int length, unsigned long long receiveTimeMs) {
+void processRtpPayload(PNV_VIDEO_PACKET videoPacket, int length, unsigned long long receiveTimeNs,
+                       PRTPFEC_QUEUE_ENTRY queueEntry) {
     BUFFER_DESC currentPos;
     int frameIndex;
     char flags;
     int firstPacket;
     int streamPacketIndex;
 
-    // Mask the top 8 bits from the SPI
-    videoPacket->streamPacketIndex >>= 8;
-    videoPacket->streamPacketIndex &= 0xFFFFFF;
-
     currentPos.data = (char*)(videoPacket + 1);
     currentPos.offset = 0;
     currentPos.length = length - sizeof(*videoPacket);
@@ -417,18 +598,22 @@ void processRtpPayload(PNV_VIDEO_PACKET videoPacket, int length, unsigned long l
     flags = videoPacket->flags;
     firstPacket = isFirstPacket(flags);
 
-    streamPacketIndex = videoPacket->streamPacketIndex;
-    
+    // Mask the top 8 bits from the SPI. The packet is left untouched since
+    // the FEC queue may still need it to recover the rest of the frame.
+    streamPacketIndex = (videoPacket->streamPacketIndex >> 8) & 0xFFFFFF;
+
     // The packets and frames must be in sequence from the FEC queue
     LC_ASSERT(!isBeforeSignedInt((short)streamPacketIndex, (short)(lastPacketInStream + 1), 0));
     LC_ASSERT(!isBeforeSignedInt(frameIndex, nextFrameNumber, 0));
 
     // Notify the listener of the latest frame we've seen from the PC
     connectionSawFrame(frameIndex);
-    
-    // Verify that we didn't receive an incomplete frame
-    LC_ASSERT(firstPacket ^ decodingFrame);
-    
+
+    // The FEC queue delivers the start of a frame before the frame is complete,
+    // so a frame it gives up on ends without its last packet. That's caught
+    // below as a dropped frame when the next one starts.
+    LC_ASSERT(firstPacket || decodingFrame);
+
     // Check sequencing of this frame to ensure we didn't
     // miss one in between
     if (firstPacket) {
@@ -447,7 +632,12 @@ void processRtpPayload(PNV_VIDEO_PACKET videoPacket, int length, unsigned long l
 
         // We're now decoding a frame
         decodingFrame = 1;
-        firstPacketReceiveTime = receiveTimeMs;
+        firstPacketReceiveTime = receiveTimeNs;
+        lastPacketReceiveTime = receiveTimeNs;
+    }
+    else if (receiveTimeNs > lastPacketReceiveTime) {
+        // Recovered packets carry the time of the parity that recovered them
+        lastPacketReceiveTime = receiveTimeNs;
     }
 
     // This must be the first packet in a frame or be contiguous with the last
@@ -490,11 +680,11 @@ void processRtpPayload(PNV_VIDEO_PACKET videoPacket, int length, unsigned long l
     if (firstPacket && isIdrFrameStart(&currentPos))
     {
         // SPS and PPS prefix is padded between NALs, so we must decode it with the slow path
-        processRtpPayloadSlow(videoPacket, &currentPos);
+        processRtpPayloadSlow(videoPacket, &currentPos, queueEntry);
     }
     else
     {
-        processRtpPayloadFast(currentPos);
+        processRtpPayloadFast(currentPos, queueEntry);
     }
 
     if (flags & FLAG_EOF) {
@@ -535,5 +725,6 @@ void queueRtpPacket(PRTPFEC_QUEUE_ENTRY queueEntry) {
 
     processRtpPayload((PNV_VIDEO_PACKET)(((char*)queueEntry->packet) + dataOffset),
                       queueEntry->length - dataOffset,
-                      queueEntry->receiveTimeMs);
+                      queueEntry->receiveTimeNs,
+                      queueEntry);
 }
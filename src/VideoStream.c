@@ -2,6 +2,7 @@
 #include "PlatformSockets.h"
 #include "PlatformThreads.h"
 #include "RtpFecQueue.h"
+#include "EventLoop.h"
 
 #define FIRST_FRAME_MAX 1500
 #define FIRST_FRAME_TIMEOUT_SEC 10
@@ -11,7 +12,22 @@
 
 #define RTP_RECV_BUFFER (512 * 1024)
 
+// Video datagrams to read per receive call where the platform can batch them
+#define RTP_RECV_BATCH 32
+
+#define UDP_PING_INTERVAL_MS 500
+
+// Packets kept posted to the kernel when it receives into them itself
+#define RTP_RING_BUFFERS 256
+
+// The packet pool holds this much video (plus FEC overhead) before
+// falling back to the heap
+#define PACKET_POOL_DURATION_MS 100
+#define PACKET_POOL_MIN_BUFFERS 128
+#define PACKET_POOL_MAX_BUFFERS 8192
+
 static RTP_FEC_QUEUE rtpQueue;
+static BUFFER_POOL packetPool;
 
 static SOCKET rtpSocket = INVALID_SOCKET;
 static SOCKET firstFrameSocket = INVALID_SOCKET;
@@ -20,6 +36,22 @@ static PLT_THREAD udpPingThread;
 static PLT_THREAD receiveThread;
 static PLT_THREAD decoderThread;
 
+// Receive and ping on the shared event loop instead of our own threads
+static int useEventLoop;
+
+// Buffers for the next receive, kept across calls
+static char* receiveBuffers[RTP_RECV_BATCH];
+
+// Set if the kernel receives straight into our packet pool
+static PUDP_RING receiveRing;
+
+// Set if the kernel coalesces runs of packets with UDP GRO
+static char* coalescedBuffer;
+
+// Set if the receive thread spins on the socket before sleeping
+static int busyPolling;
+static BUSY_POLL_STATS busyPollStats;
+
 // We can't request an IDR frame until the depacketizer knows
 // that a packet was lost. This timeout bounds the time that
 // the RTP queue will wait for missing/reordered packets.
@@ -28,18 +60,63 @@ static PLT_THREAD decoderThread;
 
 // Initialize the video stream
 void initializeVideoStream(void) {
-    initializeVideoDepacketizer(StreamConfig.packetSize);
-    RtpfInitializeQueue(&rtpQueue); //TODO RTP_QUEUE_DELAY
+    int bufferCount;
+
+    // Bitrate is in Kbps. Allow 50% on top for FEC and header overhead.
+    bufferCount = (int)(((long long)StreamConfig.bitrate * 1000 / 8 * 3 / 2) / StreamConfig.packetSize *
+                        PACKET_POOL_DURATION_MS / 1000);
+    if (bufferCount < PACKET_POOL_MIN_BUFFERS) {
+        bufferCount = PACKET_POOL_MIN_BUFFERS;
+    }
+    else if (bufferCount > PACKET_POOL_MAX_BUFFERS) {
+        bufferCount = PACKET_POOL_MAX_BUFFERS;
+    }
+
+    // Decode units point into their packets until the decoder frees them,
+    // so leave room for every frame that can be waiting on the decoder
+    if ((VideoCallbacks.capabilities & CAPABILITY_CONTIGUOUS_DECODE_UNITS) == 0) {
+        int framePackets = (int)(((long long)StreamConfig.bitrate * 1000 / 8 * 3 / 2) / StreamConfig.packetSize /
+                                 (StreamConfig.fps > 0 ? StreamConfig.fps : 60)) + 1;
+
+        if (VideoCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) {
+            bufferCount += framePackets;
+        }
+        else {
+            // Plus the one being decoded
+            bufferCount += framePackets * (DECODE_UNIT_QUEUE_SIZE + 1);
+        }
+    }
+
+#ifdef HAVE_LIBURING
+    // Leave room for the buffers posted to the receive ring
+    bufferCount += RTP_RING_BUFFERS;
+#endif
+
+    memset(&busyPollStats, 0, sizeof(busyPollStats));
+
+    initializeVideoDepacketizer(StreamConfig.packetSize, &rtpQueue, bufferCount);
+    BpInitializePool(&packetPool, StreamConfig.packetSize + MAX_RTP_HEADER_SIZE + sizeof(RTPFEC_QUEUE_ENTRY),
+                     bufferCount);
+    RtpfInitializeQueue(&rtpQueue, &packetPool); //TODO RTP_QUEUE_DELAY
 }
 
 // Clean up the video stream
 void destroyVideoStream(void) {
     destroyVideoDepacketizer();
     RtpfCleanupQueue(&rtpQueue);
+    BpDestroyPool(&packetPool);
 }
 
-// UDP Ping proc
-static void UdpPingThreadProc(void* context) {
+void LiGetFecStats(PFEC_STATS stats) {
+    RtpfGetStats(&rtpQueue, stats);
+}
+
+void LiGetBusyPollStats(PBUSY_POLL_STATS stats) {
+    memcpy(stats, &busyPollStats, sizeof(*stats));
+}
+
+// Sends one ping. Returns non-zero if the stream should stop pinging.
+static int sendPing(void) {
     char pingData[] = { 0x50, 0x49, 0x4E, 0x47 };
     struct sockaddr_in6 saddr;
     SOCK_RET err;
@@ -47,74 +124,334 @@ static void UdpPingThreadProc(void* context) {
     memcpy(&saddr, &RemoteAddr, sizeof(saddr));
     saddr.sin6_port = htons(RTP_PORT);
 
+    err = sendto(rtpSocket, pingData, sizeof(pingData), 0, (struct sockaddr*)&saddr, RemoteAddrLen);
+    if (err != sizeof(pingData)) {
+        Limelog("Video Ping: send() failed: %d\n", (int)LastSocketError());
+        ListenerCallbacks.connectionTerminated(LastSocketError());
+        return -1;
+    }
+
+    return 0;
+}
+
+// UDP Ping proc
+static void UdpPingThreadProc(void* context) {
     while (!PltIsThreadInterrupted(&udpPingThread)) {
-        err = sendto(rtpSocket, pingData, sizeof(pingData), 0, (struct sockaddr*)&saddr, RemoteAddrLen);
-        if (err != sizeof(pingData)) {
-            Limelog("Video Ping: send() failed: %d\n", (int)LastSocketError());
-            ListenerCallbacks.connectionTerminated(LastSocketError());
+        if (sendPing() != 0) {
             return;
         }
 
-        PltSleepMs(500);
+        PltSleepMs(UDP_PING_INTERVAL_MS);
     }
 }
 
-// Receive thread proc
-static void ReceiveThreadProc(void* context) {
-    int err;
-    int bufferSize, receiveSize;
-    char* buffer;
+static int UdpPingTimerProc(void* context) {
+    return sendPing();
+}
+
+// Hands a received packet to the FEC queue. The buffer is set to NULL
+// if the queue took ownership of it.
+static void addPacket(char** buffer, int length, uint64_t receiveTimeNs) {
     int queueStatus;
+    PRTP_PACKET packet;
     PRTPFEC_QUEUE_ENTRY queueEntry;
 
+    if (length == 0) {
+        return;
+    }
+
+    // RTP sequence number must be in host order for the RTP queue
+    packet = (PRTP_PACKET)&(*buffer)[0];
+    packet->sequenceNumber = htons(packet->sequenceNumber);
+
+    queueStatus = RtpfAddPacket(&rtpQueue, packet, length, receiveTimeNs,
+                                (PRTPFEC_QUEUE_ENTRY)&(*buffer)[StreamConfig.packetSize + MAX_RTP_HEADER_SIZE]);
+    if (queueStatus == RTPF_RET_QUEUED_PACKETS_READY) {
+        // The packet queue now has packets ready
+        *buffer = NULL;
+        while ((queueEntry = RtpfGetQueuedPacket(&rtpQueue)) != NULL) {
+            queueRtpPacket(queueEntry);
+            RtpfReleasePacket(&rtpQueue, queueEntry);
+        }
+    }
+    else if (queueStatus == RTPF_RET_QUEUED_NOTHING_READY) {
+        // The queue owns the buffer
+        *buffer = NULL;
+    }
+}
+
+// Receives packets the kernel coalesced with UDP GRO and splits them up
+// for the FEC queue. Returns the number of packets received, or -1 if the
+// stream should stop receiving.
+static int receiveCoalescedPackets(int wait) {
+    int err;
+    int receiveSize;
+    int segmentSize;
+    uint64_t receiveTimeNs;
+    int offset;
+    int length;
+
     receiveSize = StreamConfig.packetSize + MAX_RTP_HEADER_SIZE;
-    bufferSize = receiveSize + sizeof(RTPFEC_QUEUE_ENTRY);
-    buffer = NULL;
 
-    while (!PltIsThreadInterrupted(&receiveThread)) {
-        PRTP_PACKET packet;
+    if (wait) {
+        err = recvUdpSocketGro(rtpSocket, coalescedBuffer, UDP_GRO_MAX, &segmentSize, &receiveTimeNs);
+    }
+    else {
+        err = readUdpSocketGro(rtpSocket, coalescedBuffer, UDP_GRO_MAX, &segmentSize, &receiveTimeNs);
+    }
+    if (err < 0) {
+        Limelog("Video Receive: recvUdpSocketGro() failed: %d\n", (int)LastSocketError());
+        ListenerCallbacks.connectionTerminated(LastSocketError());
+        return -1;
+    }
+
+    // Every segment is segmentSize long except maybe the last
+    for (offset = 0; offset < err; offset += segmentSize) {
+        length = err - offset < segmentSize ? err - offset : segmentSize;
 
-        if (buffer == NULL) {
-            buffer = (char*)malloc(bufferSize);
-            if (buffer == NULL) {
-                Limelog("Video Receive: malloc() failed\n");
+        // Truncate oversized packets like recv() would
+        if (length > receiveSize) {
+            length = receiveSize;
+        }
+
+        if (receiveBuffers[0] == NULL) {
+            receiveBuffers[0] = (char*)BpAllocBuffer(&packetPool);
+            if (receiveBuffers[0] == NULL) {
+                Limelog("Video Receive: BpAllocBuffer() failed\n");
                 ListenerCallbacks.connectionTerminated(-1);
-                return;
+                return -1;
             }
         }
 
-        err = recvUdpSocket(rtpSocket, buffer, receiveSize);
-        if (err < 0) {
-            Limelog("Video Receive: recvUdpSocket() failed: %d\n", (int)LastSocketError());
-            ListenerCallbacks.connectionTerminated(LastSocketError());
-            break;
+        memcpy(receiveBuffers[0], &coalescedBuffer[offset], length);
+        addPacket(&receiveBuffers[0], length, receiveTimeNs);
+    }
+
+    return err > 0 ? (err + segmentSize - 1) / segmentSize : 0;
+}
+
+// Receives one batch of packets, waiting for it if wait is set. Returns
+// the number of packets received, or -1 if the stream should stop receiving.
+static int receivePackets(int wait) {
+    int err;
+    int receiveSize;
+    int lengths[RTP_RECV_BATCH];
+    uint64_t receiveTimesNs[RTP_RECV_BATCH];
+    int i;
+
+    if (coalescedBuffer != NULL) {
+        return receiveCoalescedPackets(wait);
+    }
+
+    receiveSize = StreamConfig.packetSize + MAX_RTP_HEADER_SIZE;
+
+    if (receiveRing != NULL) {
+        // The ring takes back the buffers the queue didn't keep
+        // and hands us the ones it filled
+        err = recvUdpRing(receiveRing, receiveBuffers, lengths, receiveTimesNs, RTP_RECV_BATCH);
+    }
+    else {
+        // Replace the buffers the queue took ownership of last time
+        for (i = 0; i < RTP_RECV_BATCH; i++) {
+            if (receiveBuffers[i] == NULL) {
+                receiveBuffers[i] = (char*)BpAllocBuffer(&packetPool);
+                if (receiveBuffers[i] == NULL) {
+                    Limelog("Video Receive: BpAllocBuffer() failed\n");
+                    ListenerCallbacks.connectionTerminated(-1);
+                    return -1;
+                }
+            }
         }
-        else if  (err == 0) {
-            // Receive timed out; try again
-            continue;
+
+        if (wait) {
+            err = recvUdpSocketBatch(rtpSocket, receiveBuffers, lengths, receiveTimesNs, receiveSize, RTP_RECV_BATCH);
+        }
+        else {
+            err = readUdpSocketBatch(rtpSocket, receiveBuffers, lengths, receiveTimesNs, receiveSize, RTP_RECV_BATCH);
         }
+    }
+    if (err < 0) {
+        Limelog("Video Receive: recvUdpSocketBatch() failed: %d\n", (int)LastSocketError());
+        ListenerCallbacks.connectionTerminated(LastSocketError());
+        return -1;
+    }
+
+    // Nothing happens here if the receive timed out
+    for (i = 0; i < err; i++) {
+        addPacket(&receiveBuffers[i], lengths[i], receiveTimesNs[i]);
+    }
+
+    return err;
+}
+
+// Reads the socket without sleeping until packets arrive or the busy poll
+// window ends, then sleeps waiting for them as usual
+static int busyPollPackets(void) {
+    uint64_t deadlineNs;
+    int err;
 
-        // RTP sequence number must be in host order for the RTP queue
-        packet = (PRTP_PACKET)&buffer[0];
-        packet->sequenceNumber = htons(packet->sequenceNumber);
-
-        queueStatus = RtpfAddPacket(&rtpQueue, packet, err, (PRTPFEC_QUEUE_ENTRY)&buffer[receiveSize]);
-        if (queueStatus == RTPF_RET_QUEUED_PACKETS_READY) {
-            // The packet queue now has packets ready
-            buffer = NULL;
-            while ((queueEntry = RtpfGetQueuedPacket(&rtpQueue)) != NULL) {
-                queueRtpPacket(queueEntry);
-                free(queueEntry->packet);
+    deadlineNs = PltGetNanos() + StreamConfig.videoBusyPollUs * 1000ULL;
+    do {
+        err = receivePackets(0);
+        if (err != 0) {
+            if (err > 0) {
+                busyPollStats.spinHits++;
             }
+            return err;
+        }
+    } while (PltGetNanos() < deadlineNs);
+
+    busyPollStats.spinMisses++;
+    return receivePackets(1);
+}
+
+// Receive thread proc
+static void ReceiveThreadProc(void* context) {
+    while (!PltIsThreadInterrupted(&receiveThread)) {
+        if ((busyPolling ? busyPollPackets() : receivePackets(1)) < 0) {
+            break;
         }
-        else if (queueStatus == RTPF_RET_QUEUED_NOTHING_READY) {
-            // The queue owns the buffer
-            buffer = NULL;
+    }
+}
+
+static int ReceiveReadableProc(void* context) {
+    return receivePackets(0) < 0;
+}
+
+static void* allocRingBuffer(void* context) {
+    return BpAllocBuffer(&packetPool);
+}
+
+static void freeRingBuffer(void* context, void* buffer) {
+    BpFreeBuffer(&packetPool, buffer);
+}
+
+// Ring buffers are only packet sized, so GRO is only used where there's no ring
+static void startCoalescing(void) {
+    if (!StreamConfig.videoUdpGro) {
+        return;
+    }
+
+    coalescedBuffer = (char*)malloc(UDP_GRO_MAX);
+    if (coalescedBuffer == NULL) {
+        return;
+    }
+
+    if (enableUdpGro(rtpSocket) != 0) {
+        free(coalescedBuffer);
+        coalescedBuffer = NULL;
+    }
+}
+
+static int startReceiving(void) {
+    int err;
+
+    if (!useEventLoop) {
+        // Receive rings always sleep waiting for packets, so they can't busy poll
+        busyPolling = StreamConfig.videoBusyPollUs > 0 &&
+                      enableBusyPoll(rtpSocket, StreamConfig.videoBusyPollUs) == 0;
+
+        // This is NULL where the kernel can't receive into our buffers itself
+        if (!busyPolling) {
+            receiveRing = createUdpRing(rtpSocket, StreamConfig.packetSize + MAX_RTP_HEADER_SIZE,
+                                        RTP_RING_BUFFERS, allocRingBuffer, freeRingBuffer, NULL);
+        }
+        if (receiveRing == NULL) {
+            startCoalescing();
+        }
+
+        err = PltCreateThread(THREAD_ROLE_VIDEO_RECEIVE, ReceiveThreadProc, NULL, &receiveThread);
+        if (err != 0) {
+            goto Fail;
         }
+
+        return 0;
+    }
+
+    startCoalescing();
+
+    err = ElStartEventLoop();
+    if (err != 0) {
+        goto Fail;
+    }
+
+    err = ElAddSocket(rtpSocket, ReceiveReadableProc, NULL);
+    if (err != 0) {
+        ElStopEventLoop();
+        goto Fail;
+    }
+
+    return 0;
+
+Fail:
+    if (receiveRing != NULL) {
+        destroyUdpRing(receiveRing);
+        receiveRing = NULL;
+    }
+    if (coalescedBuffer != NULL) {
+        free(coalescedBuffer);
+        coalescedBuffer = NULL;
     }
+    return err;
+}
+
+static void stopReceiving(void) {
+    int i;
 
-    if (buffer != NULL) {
-        free(buffer);
+    if (useEventLoop) {
+        ElRemoveSocket(rtpSocket);
+        ElStopEventLoop();
+    }
+    else {
+        PltInterruptThread(&receiveThread);
+        PltJoinThread(&receiveThread);
+        PltCloseThread(&receiveThread);
+    }
+
+    for (i = 0; i < RTP_RECV_BATCH; i++) {
+        BpFreeBuffer(&packetPool, receiveBuffers[i]);
+        receiveBuffers[i] = NULL;
+    }
+    if (receiveRing != NULL) {
+        destroyUdpRing(receiveRing);
+        receiveRing = NULL;
+    }
+    if (coalescedBuffer != NULL) {
+        free(coalescedBuffer);
+        coalescedBuffer = NULL;
+    }
+}
+
+static int startPinging(void) {
+    int err;
+
+    if (!useEventLoop) {
+        return PltCreateThread(THREAD_ROLE_VIDEO_PING, UdpPingThreadProc, NULL, &udpPingThread);
+    }
+
+    err = ElStartEventLoop();
+    if (err != 0) {
+        return err;
+    }
+
+    err = ElAddTimer(UDP_PING_INTERVAL_MS, UdpPingTimerProc, NULL);
+    if (err != 0) {
+        ElStopEventLoop();
+        return err;
+    }
+
+    return 0;
+}
+
+static void stopPinging(void) {
+    if (useEventLoop) {
+        ElRemoveTimer(UdpPingTimerProc, NULL);
+        ElStopEventLoop();
+    }
+    else {
+        PltInterruptThread(&udpPingThread);
+        PltJoinThread(&udpPingThread);
+        PltCloseThread(&udpPingThread);
     }
 }
 
@@ -155,8 +492,6 @@ void stopVideoStream(void) {
     // Wake up client code that may be waiting on the decode unit queue
     stopVideoDepacketizer();
     
-    PltInterruptThread(&udpPingThread);
-    PltInterruptThread(&receiveThread);
     if ((VideoCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
         PltInterruptThread(&decoderThread);
     }
@@ -165,15 +500,10 @@ void stopVideoStream(void) {
         shutdownTcpSocket(firstFrameSocket);
     }
 
-    PltJoinThread(&udpPingThread);
-    PltJoinThread(&receiveThread);
+    stopPinging();
+    stopReceiving();
     if ((VideoCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
         PltJoinThread(&decoderThread);
-    }
-
-    PltCloseThread(&udpPingThread);
-    PltCloseThread(&receiveThread);
-    if ((VideoCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
         PltCloseThread(&decoderThread);
     }
     
@@ -195,6 +525,9 @@ int startVideoStream(void* rendererContext, int drFlags, void* eglImage) {
 
     firstFrameSocket = INVALID_SOCKET;
 
+    // Platforms without an event loop fall back to per-stream threads
+    useEventLoop = StreamConfig.useEventLoop && ElIsSupported();
+
     // This must be called before the decoder thread starts submitting
     // decode units
     LC_ASSERT(NegotiatedVideoFormat != 0);
@@ -210,9 +543,12 @@ int startVideoStream(void* rendererContext, int drFlags, void* eglImage) {
         return LastSocketError();
     }
 
+    // Where this fails, packets are timed once we've received them
+    enableUdpTimestamps(rtpSocket);
+
     VideoCallbacks.start();
 
-    err = PltCreateThread(ReceiveThreadProc, NULL, &receiveThread);
+    err = startReceiving();
     if (err != 0) {
         VideoCallbacks.stop();
         closeSocket(rtpSocket);
@@ -221,12 +557,10 @@ int startVideoStream(void* rendererContext, int drFlags, void* eglImage) {
     }
 
     if ((VideoCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
-        err = PltCreateThread(DecoderThreadProc, NULL, &decoderThread);
+        err = PltCreateThread(THREAD_ROLE_VIDEO_DECODER, DecoderThreadProc, NULL, &decoderThread);
         if (err != 0) {
             VideoCallbacks.stop();
-            PltInterruptThread(&receiveThread);
-            PltJoinThread(&receiveThread);
-            PltCloseThread(&receiveThread);
+            stopReceiving();
             closeSocket(rtpSocket);
             VideoCallbacks.cleanup();
             return err;
@@ -240,16 +574,12 @@ int startVideoStream(void* rendererContext, int drFlags, void* eglImage) {
         if (firstFrameSocket == INVALID_SOCKET) {
             VideoCallbacks.stop();
             stopVideoDepacketizer();
-            PltInterruptThread(&receiveThread);
             if ((VideoCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
                 PltInterruptThread(&decoderThread);
             }
-            PltJoinThread(&receiveThread);
+            stopReceiving();
             if ((VideoCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
                 PltJoinThread(&decoderThread);
-            }
-            PltCloseThread(&receiveThread);
-            if ((VideoCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
                 PltCloseThread(&decoderThread);
             }
             closeSocket(rtpSocket);
@@ -260,20 +590,16 @@ int startVideoStream(void* rendererContext, int drFlags, void* eglImage) {
 
     // Start pinging before reading the first frame so GFE knows where
     // to send UDP data
-    err = PltCreateThread(UdpPingThreadProc, NULL, &udpPingThread);
+    err = startPinging();
     if (err != 0) {
         VideoCallbacks.stop();
         stopVideoDepacketizer();
-        PltInterruptThread(&receiveThread);
         if ((VideoCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
             PltInterruptThread(&decoderThread);
         }
-        PltJoinThread(&receiveThread);
+        stopReceiving();
         if ((VideoCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
             PltJoinThread(&decoderThread);
-        }
-        PltCloseThread(&receiveThread);
-        if ((VideoCallbacks.capabilities & CAPABILITY_DIRECT_SUBMIT) == 0) {
             PltCloseThread(&decoderThread);
         }
         closeSocket(rtpSocket);